@@ -0,0 +1,33 @@
+#!/bin/bash
+# オブジェクトファイルを作るまでの時間を測る。
+#
+#   ./asm.sh [行数]
+#
+# 関数定義を並べた合成ソース (既定では約 10 万行) を生成し、アセンブリを
+# 書いて cc -c でアセンブルする場合と、-c で ELF のオブジェクトファイルを
+# 直接書く場合の時間と最大 RSS を表示する。-c の出力は ELF なので、
+# リンクして試せるのは ELF の環境だけ。
+
+. "$(dirname "$0")/common.sh"
+
+lines=${1:-100000}
+
+awk -v n=$((lines / 10)) 'BEGIN {
+    for (i = 0; i < n; i++) {
+        printf("int f%d(int a, int b) {\n", i);
+        printf("    int x = a + b * 2;\n");
+        printf("    int y[4];\n");
+        printf("    y[1] = x - a / 3;\n");
+        printf("    if (x < 10) x = x - 1; else x = x + y[1];\n");
+        printf("    while (x >= 100) x = x - 3;\n");
+        printf("    for (y[0] = 0; y[0] <= 3; y[0] = y[0] + 1) x = x * 2;\n");
+        printf("    if (x != b) return x == b;\n");
+        printf("    return sizeof(y) > x;\n");
+        printf("}\n");
+    }
+}' > $tmp/gen.c
+
+echo "input: $(wc -l < $tmp/gen.c) lines, $(human $(wc -c < $tmp/gen.c))"
+measure "a.out -o .s" $CC1 -o $tmp/gen.s $tmp/gen.c
+measure "a.out -o .s && cc -c" bash -c "$CC1 -o $tmp/gen.s $tmp/gen.c && cc -c -o $tmp/gen.o $tmp/gen.s"
+measure "a.out -c" $CC1 -c -o $tmp/gen.o $tmp/gen.c
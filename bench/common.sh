@@ -0,0 +1,54 @@
+#!/bin/bash
+# ベンチマークスクリプト共通の補助関数。
+# compiler/ で `make` 済みの a.out を使う。
+
+BENCH_DIR=$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)
+CC1=${CC1:-$BENCH_DIR/../compiler/a.out}
+
+if [ ! -x "$CC1" ]; then
+    echo "$CC1 がありません。先に compiler/ で make してください" >&2
+    exit 1
+fi
+
+tmp=$(mktemp -d /tmp/compiler-bench-XXXXXX)
+trap 'rm -rf $tmp' INT TERM HUP EXIT
+
+# 数値をバイト単位の読みやすい表記にする
+human() {
+    awk -v n="$1" 'BEGIN {
+        split("B KB MB GB", u);
+        for (i = 1; n >= 1024 && i < 4; i++) n /= 1024;
+        printf("%.1f %s", n, u[i]);
+    }'
+}
+
+# measure <ラベル> <コマンド...>
+# コマンドを実行し、経過時間と最大 RSS を 1 行で表示する。
+measure() {
+    local label="$1"
+    shift
+
+    local secs rss
+    if /usr/bin/time -f '%e %M' true >/dev/null 2>&1; then
+        # GNU time: %M は KB 単位
+        read secs rss < <( { /usr/bin/time -f '%e %M' "$@" >/dev/null 2>/dev/null; } 2>&1 | tail -1)
+        rss=$((rss * 1024))
+    elif [ "$(uname)" = Darwin ]; then
+        # BSD time: maximum resident set size はバイト単位
+        local out
+        out=$( { /usr/bin/time -l "$@" >/dev/null 2>/dev/null; } 2>&1)
+        secs=$(echo "$out" | awk '/real/ { print $1; exit }')
+        rss=$(echo "$out" | awk '/maximum resident set size/ { print $1 }')
+    else
+        read secs rss < <(python3 - "$@" <<'PY'
+import resource, subprocess, sys, time
+t = time.time()
+subprocess.run(sys.argv[1:], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+ru = resource.getrusage(resource.RUSAGE_CHILDREN)
+print("%.2f %d" % (time.time() - t, ru.ru_maxrss * 1024))
+PY
+)
+    fi
+
+    printf "%-24s %8ss  %12s\n" "$label" "$secs" "$(human "$rss")"
+}
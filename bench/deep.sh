@@ -0,0 +1,58 @@
+#!/bin/bash
+# 深く入れ子になった木のコンパイル時間を測る。
+#
+#   ./deep.sh [項の数]
+#
+# 機械が生成したような長い式と "else if" の連鎖 (既定では 100 万段) を作り、
+# それぞれのコンパイルの時間と最大 RSS を表示する。木は再帰でたどらないので、
+# ネイティブのスタックを 1 MB に制限してもコンパイルできるはず。
+
+. "$(dirname "$0")/common.sh"
+
+n=${1:-1000000}
+
+# 左に深い a+a+...+a
+awk -v n=$n 'BEGIN {
+    printf("int main() { int a; a = 1; return a");
+    for (i = 1; i < n; i++)
+        printf("+a");
+    print "; }"
+}' > $tmp/left.c
+
+# 右に深い a-(a-(...(a)...))
+awk -v n=$n 'BEGIN {
+    printf("int main() { int a; a = 1; return ");
+    for (i = 1; i < n; i++)
+        printf("a-(");
+    printf("a");
+    for (i = 1; i < n; i++)
+        printf(")");
+    print "; }"
+}' > $tmp/right.c
+
+# 括弧だけの入れ子 ((...(a)...))
+awk -v n=$n 'BEGIN {
+    printf("int main() { int a; a = 1; return ");
+    for (i = 0; i < n; i++)
+        printf("(");
+    printf("a");
+    for (i = 0; i < n; i++)
+        printf(")");
+    print "; }"
+}' > $tmp/paren.c
+
+# if (x == 0) ... else if (x == 1) ... の連鎖
+awk -v n=$n 'BEGIN {
+    print "int main() { int x; int r; x = 7; r = 0;";
+    for (i = 0; i < n; i++)
+        printf("%sif (x == %d) r = r + %d;\n", i ? "else " : "", i, i);
+    print "return r; }"
+}' > $tmp/ladder.c
+
+ulimit -s 1024
+
+echo "terms: $n, stack limit: $(ulimit -s) KB"
+for f in left right paren ladder; do
+    measure "$f" $CC1 -o $tmp/$f.s $tmp/$f.c
+    [ -s $tmp/$f.s ] || echo "$f: コンパイルできませんでした" >&2
+done
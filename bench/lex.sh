@@ -0,0 +1,22 @@
+#!/bin/bash
+# トークナイズの MB/s を走査カーネル (scalar, SSE2, AVX2) ごとに測る。
+#
+#   ./lex.sh [コーパスのサイズ(MB)]
+
+. "$(dirname "$0")/common.sh"
+
+mb=${1:-32}
+
+make -s -C $BENCH_DIR lex_bench || exit 1
+
+# テストプログラムを前処理したものを繰り返し連結してコーパスを作る
+for f in $BENCH_DIR/../test/*.c; do
+    cc -E -P -C $f
+done > $tmp/unit.c
+touch $tmp/corpus.c
+while [ $(wc -c < $tmp/corpus.c) -lt $((mb * 1024 * 1024)) ]; do
+    cat $tmp/unit.c $tmp/unit.c $tmp/unit.c $tmp/unit.c >> $tmp/corpus.c
+done
+
+echo "corpus: $(human $(wc -c < $tmp/corpus.c))"
+$BENCH_DIR/lex_bench $tmp/corpus.c
@@ -0,0 +1,50 @@
+// トークナイザのスループットを走査カーネルごとに測るマイクロベンチマーク。
+//
+//   ./lex_bench <file> [回数]
+//
+// 各カーネルで <file> を指定回数トークナイズし、最速の 1 回から MB/s を求める。
+
+#include "../compiler/compiler.h"
+#include <sys/stat.h>
+#include <time.h>
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <file> [回数]\n", argv[0]);
+        return 1;
+    }
+
+    char *path = argv[1];
+    int iters = argc > 2 ? atoi(argv[2]) : 3;
+
+    struct stat st;
+    if (stat(path, &st) == -1)
+        error("cannot stat %s: %s", path, strerror(errno));
+
+    static char *isas[] = {"scalar", "sse2", "avx2"};
+    for (int i = 0; i < sizeof(isas) / sizeof(*isas); i++) {
+        if (!set_scan_isa(isas[i])) {
+            printf("%-8s (この CPU では使えません)\n", isas[i]);
+            continue;
+        }
+
+        double best = 1e9;
+        for (int j = 0; j < iters; j++) {
+            double start = now();
+            tokenize_file(path);
+            while (tokenize_next()->kind != TK_EOF)
+                ;
+            double t = now() - start;
+            if (t < best)
+                best = t;
+        }
+        printf("%-8s %8.1f MB/s\n", isas[i], st.st_size / best / 1e6);
+    }
+    return 0;
+}
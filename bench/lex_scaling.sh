@@ -0,0 +1,23 @@
+#!/bin/bash
+# 並列トークナイズの速度をスレッド数 1 から N まで測る。
+#
+#   ./lex_scaling.sh [最大スレッド数] [コーパスのサイズ(MB)]
+
+. "$(dirname "$0")/common.sh"
+
+threads=${1:-$(getconf _NPROCESSORS_ONLN)}
+mb=${2:-64}
+
+make -s -C $BENCH_DIR lex_scaling_bench || exit 1
+
+# テストプログラムを前処理したものを繰り返し連結してコーパスを作る
+for f in $BENCH_DIR/../test/*.c; do
+    cc -E -P -C $f
+done > $tmp/unit.c
+touch $tmp/corpus.c
+while [ $(wc -c < $tmp/corpus.c) -lt $((mb * 1024 * 1024)) ]; do
+    cat $tmp/unit.c $tmp/unit.c $tmp/unit.c $tmp/unit.c >> $tmp/corpus.c
+done
+
+echo "corpus: $(human $(wc -c < $tmp/corpus.c))"
+$BENCH_DIR/lex_scaling_bench $tmp/corpus.c $threads
@@ -0,0 +1,55 @@
+// 並列トークナイズのスケーリングを測るマイクロベンチマーク。
+//
+//   ./lex_scaling_bench <file> [最大スレッド数] [回数]
+//
+// スレッド数を 1 から最大スレッド数まで変えながら <file> をトークナイズし、
+// 最速の 1 回から MB/s と 1 スレッドに対する速度比を求める。
+
+#include "../compiler/compiler.h"
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <file> [最大スレッド数] [回数]\n", argv[0]);
+        return 1;
+    }
+
+    char *path = argv[1];
+    int max_threads = argc > 2 ? atoi(argv[2]) : sysconf(_SC_NPROCESSORS_ONLN);
+    int iters = argc > 3 ? atoi(argv[3]) : 3;
+
+    struct stat st;
+    if (stat(path, &st) == -1)
+        error("cannot stat %s: %s", path, strerror(errno));
+
+    init_scan();
+
+    double base = 0;
+    for (int n = 1; n <= max_threads; n++) {
+        num_threads = n;
+
+        double best = 1e9;
+        for (int j = 0; j < iters; j++) {
+            double start = now();
+            tokenize_file(path);
+            while (tokenize_next()->kind != TK_EOF)
+                ;
+            double t = now() - start;
+            if (t < best)
+                best = t;
+        }
+
+        if (n == 1)
+            base = best;
+        printf("%2d threads %8.1f MB/s  x%.2f\n", n, st.st_size / best / 1e6, base / best);
+    }
+    return 0;
+}
@@ -0,0 +1,34 @@
+#!/bin/bash
+# 構文解析にかかる時間を測る。
+#
+#   ./parse.sh [行数]
+#
+# 関数定義を並べた合成ソース (既定では約 100 万行) を生成し、
+# トークナイズと parse() それぞれの時間と、構文木の書き出しと読み込み、
+# コード生成の時間を表示する。最後に、関数を解析し終えたものから生成する
+# a.out でコンパイル全体の時間と最大 RSS を測る。
+
+. "$(dirname "$0")/common.sh"
+
+lines=${1:-1000000}
+
+make -s -C $BENCH_DIR parse_bench || exit 1
+
+awk -v n=$((lines / 10)) 'BEGIN {
+    for (i = 0; i < n; i++) {
+        printf("int f%d(int a, int b) {\n", i);
+        printf("    int x = a + b * 2;\n");
+        printf("    int y[4];\n");
+        printf("    y[1] = x - a / 3;\n");
+        printf("    if (x < 10) x = x - 1; else x = x + y[1];\n");
+        printf("    while (x >= 100) x = x - 3;\n");
+        printf("    for (y[0] = 0; y[0] <= 3; y[0] = y[0] + 1) x = x * 2;\n");
+        printf("    if (x != b) return x == b;\n");
+        printf("    return sizeof(y) > x;\n");
+        printf("}\n");
+    }
+}' > $tmp/gen.c
+
+echo "input: $(wc -l < $tmp/gen.c) lines, $(human $(wc -c < $tmp/gen.c))"
+$BENCH_DIR/parse_bench $tmp/gen.c
+measure "compile (a.out)" $CC1 -o $tmp/gen.s $tmp/gen.c
@@ -0,0 +1,65 @@
+// パーサの処理時間を測るマイクロベンチマーク。
+//
+//   ./parse_bench <file>
+//
+// <file> をトークナイズだけする場合と、トークナイズしながら parse() する場合の
+// 時間を表示する。さらに構文木を <file>.ast に書き出し、それを読み込み直す
+// 時間を parse() と比べる。最後に <file>.s へ codegen() する速さを測る。
+// 構文木を書き出すので、本体を残す parse(false) で解析する。
+
+#include "../compiler/compiler.h"
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <file>\n", argv[0]);
+        return 1;
+    }
+
+    init_scan();
+
+    double start = now();
+    tokenize_file(argv[1]);
+    while (tokenize_next()->kind != TK_EOF)
+        ;
+    double mid = now();
+    tokenize_file(argv[1]);
+    Obj *prog = parse(false);
+    double end = now();
+
+    char *path = format("%s.ast", argv[1]);
+    emit_ast(prog, path);
+    double emitted = now();
+    prog = load_ast(path);
+    double loaded = now();
+    unlink(path);
+
+    char *asm_path = format("%s.s", argv[1]);
+    FILE *out = fopen(asm_path, "w");
+    if (!out)
+        error("cannot open output file: %s: %s", asm_path, strerror(errno));
+    codegen(prog, out);
+    fclose(out);
+    double generated = now();
+
+    struct stat st;
+    stat(asm_path, &st);
+    unlink(asm_path);
+
+    printf("tokenize %8.3f s\n", mid - start);
+    printf("parse    %8.3f s (トークナイズを含む)\n", end - mid);
+    printf("emit ast %8.3f s\n", emitted - end);
+    printf("load ast %8.3f s (ソースのハッシュの確認を含む)\n", loaded - emitted);
+    printf("codegen  %8.3f s (%.1f MB, %.1f MB/s)\n", generated - loaded,
+           st.st_size / 1e6, st.st_size / 1e6 / (generated - loaded));
+    printf("peak tokens: %d\n", peak_tokens);
+    return 0;
+}
@@ -0,0 +1,29 @@
+#!/bin/bash
+# 入力ファイルの読み込み経路（mmap）のベンチマーク。
+# 1 MB, 100 MB, 1 GB の入力について経過時間と最大 RSS を表示する。
+#
+#   ./read_file.sh [サイズ(MB)...]
+
+. "$(dirname "$0")/common.sh"
+
+sizes=${@:-1 100 1024}
+
+# 大半がコメントの入力を生成する。トークナイザの処理はほぼ
+# 読み飛ばしだけなので、入力の読み込みにかかるコストが支配的になる。
+gen() {
+    local mb=$1 out=$2
+    {
+        echo '/*'
+        yes '    machine generated padding line for the input reader benchmark' |
+            head -c $((mb * 1024 * 1024))
+        echo '*/'
+        echo 'int main() { return 0; }'
+    } > $out
+}
+
+printf "%-24s %9s  %12s\n" input time "peak RSS"
+for mb in $sizes; do
+    gen $mb $tmp/in.c
+    measure "${mb} MB (file)" $CC1 -o $tmp/out.s $tmp/in.c
+    measure "${mb} MB (stdin)" sh -c "$CC1 -o $tmp/out.s - < $tmp/in.c"
+done
@@ -0,0 +1,32 @@
+#!/bin/bash
+# ローカル変数の数に対する構文解析の時間を測る。
+#
+#   ./scope.sh [変数の数...]
+#
+# 1 つの関数に多数のローカル変数を宣言し、それぞれの初期化式で最初の変数と
+# 直前の変数を参照する合成ソースを生成して、parse() の時間を表示する。
+# ところどころに同じ名前を宣言し直す内側のブロックも置く。
+# 変数の表引きが定数時間なら、時間は変数の数にほぼ比例する。
+
+. "$(dirname "$0")/common.sh"
+
+counts=${@:-10000 100000 1000000}
+
+make -s -C $BENCH_DIR parse_bench || exit 1
+
+printf "%-10s %10s %12s\n" locals parse "ns/local"
+for n in $counts; do
+    awk -v n=$n 'BEGIN {
+        print "int main() {"
+        print "    int v0 = 0;"
+        for (i = 1; i < n; i++) {
+            printf("    int v%d = v0 + v%d;\n", i, i - 1)
+            if (i % 100 == 0)
+                printf("    { int v0 = v%d; v%d = v0; }\n", i, i)
+        }
+        print "    return v0;"
+        print "}"
+    }' > $tmp/scope.c
+    $BENCH_DIR/parse_bench $tmp/scope.c |
+        awk -v n=$n '/^parse/ { printf("%-10d %9.3fs %12.1f\n", n, $2, $2 * 1e9 / n) }'
+done
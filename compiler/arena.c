@@ -0,0 +1,207 @@
+// 翻訳単位ごとのメモリアリーナ。
+//
+// パーサが作るノード、型、変数などはコード生成が終わるまで使い続け、
+// 個別に解放することはない。そこで大きなブロックから先頭に詰めて切り出し、
+// 翻訳単位の処理が終わったら arena_release() でまとめて解放する。
+//
+// 切り出す位置はスレッドごとに持つので、関数の本体を解析するワーカースレッドも
+// ロックを取らずに確保できる。ロックが要るのは新しいブロックをつなぐときだけ。
+//
+// 関数の本体のノードとローカル変数は、コードを生成したら要らなくなる。
+// そうしたものは arena_use() で切り替えた関数ごとのアリーナ (Arena) から
+// 確保し、arena_free() でその関数の分だけを解放する。型はどの関数からも
+// 共有されるので、いつも翻訳単位のアリーナから確保する。
+
+#include "compiler.h"
+#include <pthread.h>
+
+// 1 ブロックの大きさ。これより大きい要求には専用のブロックを確保する
+#define ARENA_BLOCK_SIZE (1024 * 1024)
+
+// 切り出す領域の境界。どの構造体もポインタより強い境界を必要としない
+#define ARENA_ALIGN 8
+
+// 関数ごとのアリーナの最初のブロックの大きさ。足りなくなるたびに
+// ARENA_BLOCK_SIZE まで倍にする
+#define FUNC_BLOCK_SIZE (16 * 1024)
+
+typedef struct Block Block;
+struct Block {
+    Block *next;
+    size_t size;
+    char data[];
+};
+
+// 関数ごとのアリーナ。1 度に 1 つのスレッドだけが使う
+struct Arena {
+    Block *blocks;
+    char *cur;
+    char *end;
+};
+
+static pthread_mutex_t block_lock = PTHREAD_MUTEX_INITIALIZER;
+static Block *blocks;
+static _Thread_local char *cur;
+static _Thread_local char *end;
+
+// このスレッドが確保する先。NULL なら翻訳単位のアリーナ
+static _Thread_local Arena *cur_arena;
+
+// 確保しているブロックの合計と、その最大値
+static size_t live_bytes;
+static size_t peak_bytes;
+
+// 種類ごとの確保したバイト数。各スレッドは自分の分を数え、
+// arena_flush_stats() で全体の数に足す
+static size_t arena_bytes[ARENA_NKINDS];
+static _Thread_local size_t thread_bytes[ARENA_NKINDS];
+
+static char *kind_name[] = {
+    [ARENA_NODE] = "node", [ARENA_TYPE] = "type", [ARENA_OBJ] = "obj", [ARENA_STR] = "string",
+};
+
+static void count_block(ptrdiff_t size) {
+    pthread_mutex_lock(&block_lock);
+    live_bytes += size;
+    if (peak_bytes < live_bytes)
+        peak_bytes = live_bytes;
+    pthread_mutex_unlock(&block_lock);
+}
+
+static void new_block(size_t size) {
+    if (size < ARENA_BLOCK_SIZE)
+        size = ARENA_BLOCK_SIZE;
+
+    // calloc() した大きな領域は、まだ触っていない 0 のページとして渡される
+    Block *b = calloc(1, sizeof(Block) + size);
+    if (!b)
+        error("メモリ不足です");
+    b->size = size;
+
+    pthread_mutex_lock(&block_lock);
+    b->next = blocks;
+    blocks = b;
+    pthread_mutex_unlock(&block_lock);
+    count_block(size);
+    cur = b->data;
+    end = b->data + size;
+}
+
+// 関数ごとのアリーナに新しいブロックをつなぎます。
+// 小さな関数が多いので、ブロックは小さく始めて、0 で埋めるのは切り出すときにする。
+static void new_func_block(Arena *arena, size_t size) {
+    size_t prev = arena->blocks ? arena->blocks->size : FUNC_BLOCK_SIZE / 2;
+    size_t bsize = prev < ARENA_BLOCK_SIZE ? prev * 2 : prev;
+    if (bsize < size)
+        bsize = size;
+
+    Block *b = malloc(sizeof(Block) + bsize);
+    if (!b)
+        error("メモリ不足です");
+    b->size = bsize;
+    b->next = arena->blocks;
+    arena->blocks = b;
+    arena->cur = b->data;
+    arena->end = b->data + bsize;
+    count_block(bsize);
+}
+
+// 0 で埋めた size バイトの領域を返します。
+void *arena_alloc(ArenaKind kind, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    thread_bytes[kind] += size;
+
+    Arena *arena = kind == ARENA_TYPE ? NULL : cur_arena;
+    if (arena) {
+        if ((size_t)(arena->end - arena->cur) < size)
+            new_func_block(arena, size);
+        void *p = arena->cur;
+        arena->cur += size;
+        return memset(p, 0, size);
+    }
+
+    if ((size_t)(end - cur) < size)
+        new_block(size);
+
+    void *p = cur;
+    cur += size;
+    return p;
+}
+
+Arena *arena_new(void) {
+    Arena *arena = calloc(1, sizeof(Arena));
+    if (!arena)
+        error("メモリ不足です");
+    return arena;
+}
+
+// 関数ごとのアリーナから確保したすべての領域を解放します。
+void arena_free(Arena *arena) {
+    size_t size = 0;
+    while (arena->blocks) {
+        Block *next = arena->blocks->next;
+        size += arena->blocks->size;
+        free(arena->blocks);
+        arena->blocks = next;
+    }
+    count_block(-(ptrdiff_t)size);
+    free(arena);
+}
+
+// このスレッドが以後確保する先を arena にし、前の確保先を返します。
+// NULL なら翻訳単位のアリーナに戻す。
+Arena *arena_use(Arena *arena) {
+    Arena *prev = cur_arena;
+    cur_arena = arena;
+    return prev;
+}
+
+// printf スタイルのフォーマット文字列から、アリーナに置いた文字列を作ります。
+char *arena_format(char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+
+    char *buf = arena_alloc(ARENA_STR, len + 1);
+    va_start(ap, fmt);
+    vsnprintf(buf, len + 1, fmt, ap);
+    va_end(ap);
+    return buf;
+}
+
+// このスレッドが確保したバイト数を全体の数に足します。
+// ワーカースレッドは終了する前に呼ぶ。
+void arena_flush_stats(void) {
+    pthread_mutex_lock(&block_lock);
+    for (int i = 0; i < ARENA_NKINDS; i++)
+        arena_bytes[i] += thread_bytes[i];
+    pthread_mutex_unlock(&block_lock);
+    memset(thread_bytes, 0, sizeof(thread_bytes));
+}
+
+// アリーナから確保したすべての領域を解放します。
+// ほかのスレッドがアリーナを使っていないときに呼ぶ。
+void arena_release(void) {
+    while (blocks) {
+        Block *next = blocks->next;
+        free(blocks);
+        blocks = next;
+    }
+    cur = end = NULL;
+    live_bytes = peak_bytes = 0;
+    memset(arena_bytes, 0, sizeof(arena_bytes));
+    memset(thread_bytes, 0, sizeof(thread_bytes));
+}
+
+void print_arena_stats(FILE *out) {
+    arena_flush_stats();
+
+    size_t total = 0;
+    fprintf(out, "arena:");
+    for (int i = 0; i < ARENA_NKINDS; i++) {
+        fprintf(out, " %s %zu,", kind_name[i], arena_bytes[i]);
+        total += arena_bytes[i];
+    }
+    fprintf(out, " total %zu bytes, peak %zu bytes\n", total, peak_bytes);
+}
@@ -0,0 +1,598 @@
+// 抽象構文木のバイナリ形式での保存と読み込み。
+//
+// parse() が返した Obj のリストと、そこからたどれる Node、Type、名前を
+// 1 つのファイルに書き出す。ソースが変わっていなければ、次のビルドでは
+// トークナイズと構文解析を飛ばし、読み込んだ木をそのまま codegen() に渡せる。
+//
+// ファイルの中の構造体はメモリ上と同じレイアウトで置き、ポインタのメンバには
+// ファイルの先頭からのオフセット (NULL なら 0) を入れる。どれも 8 バイト境界に
+// 置くので、ポインタを置いた位置は 8 バイトごとに 1 ビットのビットマップで表す。
+// 読み込みはファイルを書き込み可能なプライベートマッピングで mmap し、
+// ビットマップに従ってオフセットをその場でポインタに直すだけなので、
+// ノードを 1 つずつ確保したり複製したりしない。
+//
+// 型は正準化して同じ構造のものを 1 つにまとめてあり (type.c)、ポインタを
+// 比べて等しいかを調べる。読み込んだ型はそのままでは後から作る型と
+// 同じオブジェクトにならないので、読み込むときに正準な型に置き換える。
+// Obj と Node の型のメンバの位置は別のビットマップで表す。
+//
+// ソース中の位置 (Node の loc) はファイルの番号とファイル内のオフセットで
+// 表し、読み込むときに開き直したソースのバッファを指すように直す。
+// ヘッダにはソースファイルごとのハッシュを置き、どれかが変わっていれば
+// 読み込まずにエラーにする。
+//
+// 構造体のレイアウトはこのコンパイラのビルドに依存するので、別のビルドが
+// 書いたファイルは、形式の版か構造体の大きさが違えば受け付けない。
+
+#include "compiler.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define AST_MAGIC "CCAST\0\0\0"
+
+// レイアウトを変えたら上げる
+#define AST_VERSION 2
+
+// ファイルの先頭に置くヘッダ。オフセットはすべてファイルの先頭から数える
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t nfiles;
+    uint16_t node_size; // sizeof(Node)
+    uint16_t type_size; // sizeof(Type)
+    uint16_t obj_size;  // sizeof(Obj)
+    uint16_t reserved;
+    uint64_t size;      // ファイル全体の大きさ
+    uint64_t prog;      // 最初の Obj
+    uint64_t files;     // AstFile の配列
+    uint64_t ptr_map;   // ポインタを置いた位置のビットマップ
+    uint64_t loc_map;   // ソース中の位置を置いた位置のビットマップ
+    uint64_t type_map;  // Obj と Node の型へのポインタを置いた位置のビットマップ
+    uint64_t map_words; // ビットマップの長さ (uint64_t の数)
+} AstHeader;
+
+// 構文木を作るときに読んだソースファイル
+typedef struct {
+    uint64_t name; // ファイル名
+    uint64_t size;
+    uint64_t hash;
+} AstFile;
+
+// ソース中の位置は (ファイルの番号 + 1) << LOC_FILE_SHIFT | オフセット で表す
+#define LOC_FILE_SHIFT 40
+
+static uint64_t hash_bytes(char *p, size_t len) {
+    // FNV-1a
+    uint64_t h = 0xcbf29ce484222325;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char)p[i]) * 0x100000001b3;
+    return h;
+}
+
+//
+// 書き出し
+//
+
+// 書き出すものの種類
+typedef enum {
+    AST_OBJ,
+    AST_NODE,
+    AST_TYPE,
+    AST_NODES, // Node * の配列
+    AST_TYPES, // Type * の配列
+    AST_BYTES, // 名前や初期値のバイト列
+} AstKind;
+
+// 場所だけを確保し、中のポインタをまだ直していないもの
+typedef struct {
+    AstKind kind;
+    void *ptr;
+    uint64_t off;
+    int len; // 配列の要素数
+} AstItem;
+
+// 書き出し中のファイルの内容
+static char *buf;
+static uint64_t buf_len;
+static uint64_t buf_cap;
+
+// メモリ上のアドレスから、書き出した位置への表
+typedef struct {
+    void *ptr;
+    uint64_t off;
+} AstSlot;
+
+static AstSlot *slots;
+static int nslots;
+static int slots_cap;
+
+static AstItem *items;
+static int nitems;
+static int items_cap;
+
+// buf の 8 バイトごとに 1 ビット
+static uint64_t *ptr_map;
+static uint64_t *loc_map;
+static uint64_t *type_map;
+static uint64_t map_words;
+
+// 書き出した位置を 8 バイト境界にそろえて len バイトを確保します。
+// 確保した領域は呼び出し側がすべて書く。
+static uint64_t reserve(uint64_t len) {
+    uint64_t off = (buf_len + 7) & ~(uint64_t)7;
+    if (off + len > buf_cap) {
+        while (off + len > buf_cap)
+            buf_cap = buf_cap ? buf_cap * 2 : 1024 * 1024;
+        buf = realloc(buf, buf_cap);
+
+        uint64_t words = buf_cap / 8 / 64;
+        ptr_map = realloc(ptr_map, sizeof(uint64_t) * words);
+        loc_map = realloc(loc_map, sizeof(uint64_t) * words);
+        type_map = realloc(type_map, sizeof(uint64_t) * words);
+        if (!buf || !ptr_map || !loc_map || !type_map)
+            error("メモリ不足です");
+        memset(ptr_map + map_words, 0, sizeof(uint64_t) * (words - map_words));
+        memset(loc_map + map_words, 0, sizeof(uint64_t) * (words - map_words));
+        memset(type_map + map_words, 0, sizeof(uint64_t) * (words - map_words));
+        map_words = words;
+    }
+    memset(buf + buf_len, 0, off - buf_len);
+    buf_len = off + len;
+    return off;
+}
+
+static void mark(uint64_t *map, uint64_t off) {
+    map[off / 8 / 64] |= (uint64_t)1 << (off / 8 % 64);
+}
+
+static AstSlot *find_slot(void *ptr) {
+    uint64_t h = (uintptr_t)ptr * 0x9e3779b97f4a7c15;
+    for (int i = h >> 32 & (slots_cap - 1);; i = (i + 1) & (slots_cap - 1))
+        if (!slots[i].ptr || slots[i].ptr == ptr)
+            return &slots[i];
+}
+
+static void grow_slots(void) {
+    AstSlot *old = slots;
+    int old_cap = slots_cap;
+    slots_cap = slots_cap ? slots_cap * 2 : 4096;
+    slots = calloc(slots_cap, sizeof(AstSlot));
+    if (!slots)
+        error("メモリ不足です");
+    for (int i = 0; i < old_cap; i++)
+        if (old[i].ptr)
+            *find_slot(old[i].ptr) = old[i];
+    free(old);
+}
+
+// ptr の指すものを書き出す位置を返します。初めて見たものなら場所を確保し、
+// 中身をコピーして、中のポインタを後で直すために items に積む。
+// 木のノードとその配列は親からしか指されないので、表を引かずに書き出す。
+static uint64_t place(AstKind kind, void *ptr, size_t size, int len) {
+    if (!ptr)
+        return 0;
+
+    AstSlot *slot = NULL;
+    if (kind != AST_NODE && kind != AST_NODES) {
+        if ((nslots + 1) * 2 > slots_cap)
+            grow_slots();
+        slot = find_slot(ptr);
+        if (slot->ptr)
+            return slot->off;
+    }
+
+    uint64_t off = reserve(size);
+    memcpy(buf + off, ptr, size);
+    if (slot) {
+        *slot = (AstSlot){ptr, off};
+        nslots++;
+    }
+
+    if (kind == AST_BYTES)
+        return off;
+    if (nitems == items_cap) {
+        items_cap = items_cap ? items_cap * 2 : 1024;
+        items = realloc(items, sizeof(AstItem) * items_cap);
+        if (!items)
+            error("メモリ不足です");
+    }
+    items[nitems++] = (AstItem){kind, ptr, off, len};
+    return off;
+}
+
+// 書き出したものの中の off の位置にあるポインタを target に置き換えます。
+static void set_pointer(uint64_t off, uint64_t target) {
+    memcpy(buf + off, &target, sizeof(target));
+    if (target)
+        mark(ptr_map, off);
+}
+
+#define FIELD(base, type, member) ((base) + offsetof(type, member))
+
+static uint64_t place_str(char *s) {
+    return s ? place(AST_BYTES, s, strlen(s) + 1, 0) : 0;
+}
+
+static uint64_t place_obj(Obj *var) {
+    return place(AST_OBJ, var, sizeof(Obj), 0);
+}
+
+static uint64_t place_node(Node *node) {
+    return node ? place(AST_NODE, node, node_size(node->kind), 0) : 0;
+}
+
+static uint64_t place_type(Type *ty) {
+    return place(AST_TYPE, ty, sizeof(Type), 0);
+}
+
+// 空の配列は次に確保したものと同じアドレスを指していることがあるので置かない
+static uint64_t place_array(AstKind kind, void *arr, int len) {
+    return len ? place(kind, arr, sizeof(void *) * len, len) : 0;
+}
+
+// off の位置にある Obj か Node の型を ty を書き出した位置に置き換えます。
+static void set_type(uint64_t off, Type *ty) {
+    set_pointer(off, place_type(ty));
+    if (ty)
+        mark(type_map, off);
+}
+
+static void write_loc(uint64_t off, char *loc) {
+    static File *last;
+    File *file = last && last->contents <= loc && loc <= last->contents + last->size ?
+        last : find_file(loc);
+
+    uint64_t val = 0;
+    if (file) {
+        last = file;
+        val = (uint64_t)(file->index + 1) << LOC_FILE_SHIFT | (loc - file->contents);
+        mark(loc_map, off);
+    }
+    memcpy(buf + off, &val, sizeof(val));
+}
+
+// item の中のポインタを書き出した位置に直します。
+static void fix_item(AstItem item) {
+    uint64_t o = item.off;
+
+    switch (item.kind) {
+    case AST_OBJ: {
+        Obj *var = item.ptr;
+        set_pointer(FIELD(o, Obj, next), place_obj(var->next));
+        set_pointer(FIELD(o, Obj, name), place_str(var->name));
+        set_type(FIELD(o, Obj, ty), var->ty);
+        set_pointer(FIELD(o, Obj, init_data),
+                    var->init_data ? place(AST_BYTES, var->init_data, var->ty->size, 0) : 0);
+        set_pointer(FIELD(o, Obj, params), place_obj(var->params));
+        set_pointer(FIELD(o, Obj, body), place_node(var->body));
+        set_pointer(FIELD(o, Obj, locals), place_obj(var->locals));
+        return;
+    }
+    case AST_TYPE: {
+        Type *ty = item.ptr;
+        set_pointer(FIELD(o, Type, base), place_type(ty->base));
+        set_pointer(FIELD(o, Type, return_ty), place_type(ty->return_ty));
+        set_pointer(FIELD(o, Type, params), place_array(AST_TYPES, ty->params, ty->nparams));
+        return;
+    }
+    case AST_NODES:
+        for (int i = 0; i < item.len; i++)
+            set_pointer(o + sizeof(Node *) * i, place_node(((Node **)item.ptr)[i]));
+        return;
+    case AST_TYPES:
+        for (int i = 0; i < item.len; i++)
+            set_pointer(o + sizeof(Type *) * i, place_type(((Type **)item.ptr)[i]));
+        return;
+    case AST_BYTES:
+        return;
+    case AST_NODE:
+        break;
+    }
+
+    Node *node = item.ptr;
+    write_loc(FIELD(o, Node, loc), node->loc);
+    set_type(FIELD(o, Node, ty), node->ty);
+
+    switch (node->kind) {
+    case ND_NUM:
+        return;
+    case ND_VAR:
+        set_pointer(FIELD(o, Node, var), place_obj(node->var));
+        return;
+    case ND_NEG:
+    case ND_ADDR:
+    case ND_DEREF:
+    case ND_RETURN:
+    case ND_EXPR_STMT:
+        set_pointer(FIELD(o, Node, lhs), place_node(node->lhs));
+        return;
+    case ND_IF:
+    case ND_FOR:
+        set_pointer(FIELD(o, Node, cond), place_node(node->cond));
+        set_pointer(FIELD(o, Node, then), place_node(node->then));
+        set_pointer(FIELD(o, Node, els), place_node(node->els));
+        if (node->kind == ND_FOR)
+            set_pointer(FIELD(o, Node, inc), place_node(node->inc));
+        return;
+    case ND_BLOCK:
+    case ND_STMT_EXPR:
+        set_pointer(FIELD(o, Node, body), place_array(AST_NODES, node->body, node->nbody));
+        return;
+    case ND_FUNCALL:
+        set_pointer(FIELD(o, Node, funcname), place_str(node->funcname));
+        set_pointer(FIELD(o, Node, args), place_array(AST_NODES, node->args, node->nargs));
+        return;
+    default:
+        set_pointer(FIELD(o, Node, lhs), place_node(node->lhs));
+        set_pointer(FIELD(o, Node, rhs), place_node(node->rhs));
+        return;
+    }
+}
+
+// prog を path に書き出します。
+void emit_ast(Obj *prog, char *path) {
+    buf_len = nslots = nitems = 0;
+
+    uint64_t header = reserve(sizeof(AstHeader));
+    uint64_t prog_off = place_obj(prog);
+
+    // 深く入れ子になった木でも再帰しないように、積んだものを順に直す
+    while (nitems > 0)
+        fix_item(items[--nitems]);
+
+    int nfiles;
+    File **files = get_files(&nfiles);
+    uint64_t files_off = reserve(sizeof(AstFile) * nfiles);
+    for (int i = 0; i < nfiles; i++) {
+        AstFile f = {
+            .name = place_str(files[i]->name),
+            .size = files[i]->size,
+            .hash = hash_bytes(files[i]->contents, files[i]->size),
+        };
+        memcpy(buf + files_off + sizeof(AstFile) * i, &f, sizeof(f));
+    }
+
+    // ビットマップは、その前に書いたところまでを表す
+    uint64_t words = (buf_len + 8 * 64 - 1) / 8 / 64;
+    uint64_t ptr_map_off = reserve(sizeof(uint64_t) * words);
+    uint64_t loc_map_off = reserve(sizeof(uint64_t) * words);
+    uint64_t type_map_off = reserve(sizeof(uint64_t) * words);
+    memcpy(buf + ptr_map_off, ptr_map, sizeof(uint64_t) * words);
+    memcpy(buf + loc_map_off, loc_map, sizeof(uint64_t) * words);
+    memcpy(buf + type_map_off, type_map, sizeof(uint64_t) * words);
+
+    AstHeader h = {
+        .magic = AST_MAGIC,
+        .version = AST_VERSION,
+        .node_size = sizeof(Node),
+        .type_size = sizeof(Type),
+        .obj_size = sizeof(Obj),
+        .nfiles = nfiles,
+        .size = buf_len,
+        .prog = prog_off,
+        .files = files_off,
+        .ptr_map = ptr_map_off,
+        .loc_map = loc_map_off,
+        .type_map = type_map_off,
+        .map_words = words,
+    };
+    memcpy(buf + header, &h, sizeof(h));
+
+    FILE *out = fopen(path, "w");
+    if (!out)
+        error("cannot open output file: %s: %s", path, strerror(errno));
+    if (fwrite(buf, 1, buf_len, out) != buf_len || fclose(out))
+        error("cannot write %s: %s", path, strerror(errno));
+
+    free(buf);
+    free(slots);
+    free(items);
+    free(ptr_map);
+    free(loc_map);
+    free(type_map);
+    buf = NULL;
+    slots = NULL;
+    items = NULL;
+    ptr_map = loc_map = type_map = NULL;
+    buf_cap = slots_cap = items_cap = map_words = 0;
+}
+
+//
+// 読み込み
+//
+
+// 読み込んだ型から正準な型への表
+typedef struct {
+    Type *ty;
+    Type *canon;
+} TypeSlot;
+
+static TypeSlot *type_slots;
+static int ntype_slots;
+static int type_slots_cap;
+
+static TypeSlot *find_type_slot(Type *ty) {
+    uint64_t h = (uintptr_t)ty * 0x9e3779b97f4a7c15;
+    for (int i = h >> 32 & (type_slots_cap - 1);; i = (i + 1) & (type_slots_cap - 1))
+        if (!type_slots[i].ty || type_slots[i].ty == ty)
+            return &type_slots[i];
+}
+
+static void add_type_slot(Type *ty, Type *canon) {
+    if ((ntype_slots + 1) * 2 > type_slots_cap) {
+        TypeSlot *old = type_slots;
+        int old_cap = type_slots_cap;
+        type_slots_cap = type_slots_cap ? type_slots_cap * 2 : 256;
+        type_slots = calloc(type_slots_cap, sizeof(TypeSlot));
+        if (!type_slots)
+            error("メモリ不足です");
+        for (int i = 0; i < old_cap; i++)
+            if (old[i].ty)
+                *find_type_slot(old[i].ty) = old[i];
+        free(old);
+    }
+    *find_type_slot(ty) = (TypeSlot){ty, canon};
+    ntype_slots++;
+}
+
+// 正準化していない型なら NULL を返す
+static Type *lookup_type(Type *ty) {
+    return ty && ntype_slots ? find_type_slot(ty)->canon : NULL;
+}
+
+// 正準化を待つ型のスタック
+static Type **type_stack;
+static int type_stack_len;
+static int type_stack_cap;
+
+static void push_type(Type *ty) {
+    if (type_stack_len == type_stack_cap) {
+        type_stack_cap = type_stack_cap ? type_stack_cap * 2 : 64;
+        type_stack = realloc(type_stack, sizeof(Type *) * type_stack_cap);
+        if (!type_stack)
+            error("メモリ不足です");
+    }
+    type_stack[type_stack_len++] = ty;
+}
+
+// ty がまだ正準化されていなければ、スタックに積んで true を返します。
+static bool push_pending(Type *ty) {
+    if (!ty || lookup_type(ty))
+        return false;
+    push_type(ty);
+    return true;
+}
+
+// 読み込んだ型 ty と同じ構造の正準な型を返します。
+// 構成要素から先に正準化する。型は深く入れ子になっていることがあるので、
+// 再帰せずに作業用のスタックに積んで進める。
+static Type *canonicalize(Type *ty) {
+    push_pending(ty);
+
+    while (type_stack_len > 0) {
+        Type *t = type_stack[type_stack_len - 1];
+        if (lookup_type(t)) {
+            type_stack_len--;
+            continue;
+        }
+
+        // まだ正準化していない構成要素があれば、それを先に済ませる
+        bool pending = push_pending(t->base) | push_pending(t->return_ty);
+        for (int i = 0; i < t->nparams; i++)
+            pending |= push_pending(t->params[i]);
+        if (pending)
+            continue;
+
+        // 読み込んだ型はこのプロセスだけのコピーなので、構成要素をその場で
+        // 正準な型に置き換えてから引く。表になければ canonical_type() が複製する。
+        t->base = lookup_type(t->base);
+        t->return_ty = lookup_type(t->return_ty);
+        for (int i = 0; i < t->nparams; i++)
+            t->params[i] = lookup_type(t->params[i]);
+        add_type_slot(t, canonical_type(t));
+        type_stack_len--;
+    }
+    return lookup_type(ty);
+}
+
+// path に書き出した構文木を読み込み、最初の Obj を返します。
+// 構文木を作ったときのソースファイルも読み込み、変わっていればエラーにする。
+Obj *load_ast(char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        error("cannot open %s: %s", path, strerror(errno));
+
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        error("cannot stat %s: %s", path, strerror(errno));
+    if ((size_t)st.st_size < sizeof(AstHeader))
+        error("%s: not an AST file", path);
+
+    // 書き換えたページはこのプロセスだけのコピーになり、ファイルには書き戻さない。
+    // ポインタはどのページにもあって結局すべて書き換えるので、できるなら
+    // 先にまとめて読み込んでおき、ページごとのフォールトを避ける
+    int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+    flags |= MAP_POPULATE;
+#endif
+    char *base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, flags, fd, 0);
+    if (base == MAP_FAILED)
+        error("cannot mmap %s: %s", path, strerror(errno));
+    close(fd);
+
+    AstHeader *h = (AstHeader *)base;
+    if (memcmp(h->magic, AST_MAGIC, sizeof(h->magic)))
+        error("%s: not an AST file", path);
+    if (h->version != AST_VERSION || h->node_size != sizeof(Node) ||
+        h->type_size != sizeof(Type) || h->obj_size != sizeof(Obj))
+        error("%s: AST file was written by a different version of the compiler", path);
+
+    uint64_t size = st.st_size;
+    if (h->size != size || h->files > size || h->nfiles > (size - h->files) / sizeof(AstFile) ||
+        h->map_words > size / 8 / 64 + 1 ||
+        h->ptr_map > size || h->map_words > (size - h->ptr_map) / sizeof(uint64_t) ||
+        h->loc_map > size || h->map_words > (size - h->loc_map) / sizeof(uint64_t) ||
+        h->type_map > size || h->map_words > (size - h->type_map) / sizeof(uint64_t) ||
+        h->prog > size - sizeof(Obj))
+        error("%s: corrupted AST file", path);
+
+    // ソースを読み込み直して、変わっていないことを確かめる
+    AstFile *afiles = (AstFile *)(base + h->files);
+    File **files = calloc(h->nfiles, sizeof(File *));
+    for (uint32_t i = 0; i < h->nfiles; i++) {
+        if (afiles[i].name >= size || !memchr(base + afiles[i].name, '\0', size - afiles[i].name))
+            error("%s: corrupted AST file", path);
+        char *name = strdup(base + afiles[i].name);
+        files[i] = load_file(name);
+        if (files[i]->size != afiles[i].size ||
+            hash_bytes(files[i]->contents, files[i]->size) != afiles[i].hash)
+            error("%s: AST file is out of date: %s has changed", path, name);
+    }
+
+    // オフセットをポインタに直す
+    uint64_t *ptr_map = (uint64_t *)(base + h->ptr_map);
+    uint64_t *loc_map = (uint64_t *)(base + h->loc_map);
+    for (uint64_t i = 0; i < h->map_words; i++) {
+        for (uint64_t bits = ptr_map[i]; bits; bits &= bits - 1) {
+            uint64_t off = (i * 64 + __builtin_ctzll(bits)) * 8;
+            uint64_t *p = (uint64_t *)(base + off);
+            if (off > size - sizeof(uint64_t) || *p >= size)
+                error("%s: corrupted AST file", path);
+            *(char **)p = base + *p;
+        }
+
+        for (uint64_t bits = loc_map[i]; bits; bits &= bits - 1) {
+            uint64_t off = (i * 64 + __builtin_ctzll(bits)) * 8;
+            uint64_t *p = (uint64_t *)(base + off);
+            if (off > size - sizeof(uint64_t))
+                error("%s: corrupted AST file", path);
+            uint64_t file = (*p >> LOC_FILE_SHIFT) - 1;
+            uint64_t offset = *p & (((uint64_t)1 << LOC_FILE_SHIFT) - 1);
+            if (file >= h->nfiles || offset > files[file]->size)
+                error("%s: corrupted AST file", path);
+            *(char **)p = files[file]->contents + offset;
+        }
+    }
+
+    // Obj と Node の型を正準な型に置き換える
+    uint64_t *type_map = (uint64_t *)(base + h->type_map);
+    for (uint64_t i = 0; i < h->map_words; i++) {
+        for (uint64_t bits = type_map[i]; bits; bits &= bits - 1) {
+            uint64_t off = (i * 64 + __builtin_ctzll(bits)) * 8;
+            if (off > size - sizeof(Type *))
+                error("%s: corrupted AST file", path);
+            Type **p = (Type **)(base + off);
+            *p = canonicalize(*p);
+        }
+    }
+
+    free(type_slots);
+    free(type_stack);
+    type_slots = NULL;
+    type_stack = NULL;
+    ntype_slots = type_slots_cap = type_stack_len = type_stack_cap = 0;
+    free(files);
+    return h->prog ? (Obj *)(base + h->prog) : NULL;
+}
@@ -1,41 +1,464 @@
 #include "compiler.h"
+#include <pthread.h>
+#include <unistd.h>
+
+// 引数を渡すレジスタ。下の表の添字
+typedef enum { RDI, RSI, RDX, RCX, R8, R9 } Reg;
 
-static FILE *output_file;
-static int depth;
 static char *argreg8[] = {"%dil", "%sil", "%dl", "%cl", "%r8b", "%r9b"};
 static char *argreg64[] = {"%rdi", "%rsi", "%rdx", "%rcx", "%r8", "%r9"};
-static Obj *current_fn;
-#define MAX_STACK_DEPTH 10000
 
-static void gen_expr(Node *node);
-static void gen_stmt(Node *node);
+// 機械語でのレジスタの番号。8 以上は REX プレフィックスで拡張する
+static int argreg_code[] = {7, 6, 2, 1, 8, 9};
+
+// 生成中の関数の状態。関数はスレッドごとに生成する
+static _Thread_local Obj *current_fn;
+static _Thread_local int depth;
+static _Thread_local int nlabels;
+
+//
+// 出力
+//
+// 1 行ごとに vfprintf() で書式を解釈すると、大きな入力ではそれがコード生成の
+// 時間の大半を占める。そこでアセンブリは大きなバッファに自前で組み立てる。
+// 出力ファイルに向けたバッファは、いっぱいになったら write() でまとめて
+// 書き出す。ワーカースレッドが関数を生成するバッファは伸ばしながら溜め、
+// 主スレッドがソースの順に書き出す。
+//
+// 関数はソースの順に .text に並べ、最後に大域変数と文字列リテラルを .data に
+// 並べる。解析し終えた関数からすぐに生成する場合 (codegen_function()) も、
+// 構文木全体から生成する場合 (codegen()) も同じ出力になる。
+//
+// output_object が真なら、アセンブリの代わりに機械語を関数ごとのバッファに
+// 組み立て、elf.c が ELF のオブジェクトファイルにまとめる。
+//
+
+#define OUTPUT_BUF_SIZE (1024 * 1024)
+
+struct Output {
+    char *buf;
+    size_t len;
+    size_t cap;
+    int fd; // 書き出す先。-1 なら buf を伸ばして溜める
+
+    // 機械語を組み立てるときだけ使う
+    Obj *fn;       // 生成した関数
+    Reloc *relocs; // リンカが埋める場所
+    int nrelocs;
+    int relocs_cap;
+};
+
+static Output file_output;
+static _Thread_local Output *output;
+
+void write_all(int fd, char *p, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            error("cannot write output: %s", strerror(errno));
+        }
+        p += n;
+        len -= n;
+    }
+}
+
+static void flush_output(void) {
+    write_all(output->fd, output->buf, output->len);
+    output->len = 0;
+}
+
+// バッファに len バイト以上の空きを作ります。
+static void make_room(size_t len) {
+    Output *o = output;
+    if (o->cap - o->len >= len)
+        return;
+
+    if (o->fd != -1) {
+        flush_output();
+        if (o->cap >= len)
+            return;
+    }
+
+    while (o->cap - o->len < len)
+        o->cap = o->cap ? o->cap * 2 : 4096;
+    o->buf = realloc(o->buf, o->cap);
+    if (!o->buf)
+        error("メモリ不足です");
+}
+
+static void emit(char *s, size_t len) {
+    make_room(len);
+    memcpy(output->buf + output->len, s, len);
+    output->len += len;
+}
+
+static void emit_char(char c) {
+    make_room(1);
+    output->buf[output->len++] = c;
+}
+
+static void emit_str(char *s) {
+    emit(s, strlen(s));
+}
+
+// s と改行を書きます。
+static void emit_line(char *s) {
+    emit_str(s);
+    emit_char('\n');
+}
+
+// 整数を 10 進数で書きます。
+static void emit_int(long val) {
+    char tmp[24];
+    char *p = tmp + sizeof(tmp);
+    unsigned long u = val < 0 ? -(unsigned long)val : (unsigned long)val;
+    do {
+        *--p = '0' + u % 10;
+        u /= 10;
+    } while (u);
+    if (val < 0)
+        *--p = '-';
+    emit(p, tmp + sizeof(tmp) - p);
+}
 
+// fmt に従って 1 行を書きます。使える変換は %d、%s、%% だけ。
 static void println(char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
-    vfprintf(output_file, fmt, ap);
+    for (char *p = fmt;;) {
+        char *q = p;
+        while (*q && *q != '%')
+            q++;
+        emit(p, q - p);
+        if (!*q)
+            break;
+
+        switch (q[1]) {
+        case 'd':
+            emit_int(va_arg(ap, int));
+            break;
+        case 's':
+            emit_str(va_arg(ap, char *));
+            break;
+        case '%':
+            emit_char('%');
+            break;
+        default:
+            error("internal error: unsupported format: %s", fmt);
+        }
+        p = q + 2;
+    }
     va_end(ap);
-    fprintf(output_file, "\n");
+    emit_char('\n');
+}
+
+//
+// 命令
+//
+// コード生成が使う命令は少ないので、アセンブラを通さずに機械語も直接書ける。
+// 命令ごとにアセンブリのテキストと機械語の両方を持ち、output_object に
+// 従ってどちらかを書く。関数の中のラベルへのジャンプは、関数を生成し
+// 終えてから埋める。関数や大域変数のアドレスはリンカが埋めるので、
+// 再配置 (Reloc) として残す。
+//
+
+bool output_object;
+
+// オペランドを取らない命令
+typedef enum {
+    I_PUSH_RAX,
+    I_PUSH_RBP,
+    I_POP_RBP,
+    I_MOV_RSP_RBP,
+    I_MOV_RBP_RSP,
+    I_RET,
+    I_NEG,
+    I_LOAD8,
+    I_LOAD64,
+    I_STORE8,
+    I_STORE64,
+    I_ADD,
+    I_SUB,
+    I_MOV_RDI_RAX,
+    I_IMUL,
+    I_MOV_RAX_RCX,
+    I_CQO,
+    I_IDIV,
+    I_CMP,
+    I_CMP_ZERO,
+    I_SETE,
+    I_SETNE,
+    I_SETL,
+    I_SETLE,
+    I_MOVZB,
+} Insn;
+
+static struct {
+    char *text;
+    char *code;
+    int len;
+} insns[] = {
+    [I_PUSH_RAX]    = {"  pushq %rax", "\x50", 1},
+    [I_PUSH_RBP]    = {"  pushq %rbp", "\x55", 1},
+    [I_POP_RBP]     = {"  popq %rbp", "\x5d", 1},
+    [I_MOV_RSP_RBP] = {"  movq %rsp, %rbp", "\x48\x89\xe5", 3},
+    [I_MOV_RBP_RSP] = {"  movq %rbp, %rsp", "\x48\x89\xec", 3},
+    [I_RET]         = {"  ret", "\xc3", 1},
+    [I_NEG]         = {"  negq %rax", "\x48\xf7\xd8", 3},
+    [I_LOAD8]       = {"  movsbq (%rax), %rax", "\x48\x0f\xbe\x00", 4},
+    [I_LOAD64]      = {"  movq (%rax), %rax", "\x48\x8b\x00", 3},
+    [I_STORE8]      = {"  movb %al, (%rdi)", "\x88\x07", 2},
+    [I_STORE64]     = {"  movq %rax, (%rdi)", "\x48\x89\x07", 3},
+    [I_ADD]         = {"  addq %rdi, %rax", "\x48\x01\xf8", 3},
+    [I_SUB]         = {"  subq %rax, %rdi", "\x48\x29\xc7", 3},
+    [I_MOV_RDI_RAX] = {"  movq %rdi, %rax", "\x48\x89\xf8", 3},
+    [I_IMUL]        = {"  imulq %rdi, %rax", "\x48\x0f\xaf\xc7", 4},
+    [I_MOV_RAX_RCX] = {"  movq %rax, %rcx", "\x48\x89\xc1", 3},
+    [I_CQO]         = {"  cqo", "\x48\x99", 2},
+    [I_IDIV]        = {"  idivq %rcx", "\x48\xf7\xf9", 3},
+    [I_CMP]         = {"  cmpq %rax, %rdi", "\x48\x39\xc7", 3},
+    [I_CMP_ZERO]    = {"  cmp $0, %rax", "\x48\x83\xf8\x00", 4},
+    [I_SETE]        = {"  sete %al", "\x0f\x94\xc0", 3},
+    [I_SETNE]       = {"  setne %al", "\x0f\x95\xc0", 3},
+    [I_SETL]        = {"  setl %al", "\x0f\x9c\xc0", 3},
+    [I_SETLE]       = {"  setle %al", "\x0f\x9e\xc0", 3},
+    [I_MOVZB]       = {"  movzbq %al, %rax", "\x48\x0f\xb6\xc0", 4},
+};
+
+static void emit_insn(Insn insn) {
+    if (output_object)
+        emit(insns[insn].code, insns[insn].len);
+    else
+        emit_line(insns[insn].text);
+}
+
+static void put_u32(char *p, uint32_t val) {
+    p[0] = val;
+    p[1] = val >> 8;
+    p[2] = val >> 16;
+    p[3] = val >> 24;
+}
+
+static void emit_u32(uint32_t val) {
+    make_room(4);
+    put_u32(output->buf + output->len, val);
+    output->len += 4;
+}
+
+// 次に書く 4 バイトをリンカが name のアドレスで埋めるように記録します。
+static void add_reloc(int type, char *name) {
+    Output *o = output;
+    if (o->nrelocs == o->relocs_cap) {
+        o->relocs_cap = o->relocs_cap ? o->relocs_cap * 2 : 16;
+        o->relocs = realloc(o->relocs, sizeof(Reloc) * o->relocs_cap);
+        if (!o->relocs)
+            error("メモリ不足です");
+    }
+    o->relocs[o->nrelocs++] = (Reloc){o->len, type, name};
+}
+
+// レジスタ reg と disp(%rbp) を指す ModR/M バイトと変位を書きます。
+static void emit_rbp_operand(int reg, int disp) {
+    if (-128 <= disp && disp < 128) {
+        emit_char(0x45 | (reg & 7) << 3);
+        emit_char(disp);
+    } else {
+        emit_char(0x85 | (reg & 7) << 3);
+        emit_u32(disp);
+    }
+}
+
+// movq $val, %rax
+static void emit_mov_imm(int val) {
+    if (output_object) {
+        emit("\x48\xc7\xc0", 3);
+        emit_u32(val);
+        return;
+    }
+    emit_str("  movq $");
+    emit_int(val);
+    emit_line(", %rax");
+}
+
+// lea offset(%rbp), %rax
+static void emit_lea_local(int offset) {
+    if (output_object) {
+        emit("\x48\x8d", 2);
+        emit_rbp_operand(0, offset);
+        return;
+    }
+    emit_str("  lea ");
+    emit_int(offset);
+    emit_line("(%rbp), %rax");
+}
+
+// lea name(%rip), %rax
+static void emit_lea_global(char *name) {
+    if (output_object) {
+        emit("\x48\x8d\x05", 3);
+        add_reloc(R_X86_64_PC32, name);
+        emit_u32(0);
+        return;
+    }
+    println("  lea %s(%%rip), %%rax", name);
+}
+
+static void emit_call(char *name) {
+    if (output_object) {
+        emit_char(0xe8);
+        add_reloc(R_X86_64_PLT32, name);
+        emit_u32(0);
+        return;
+    }
+    println("  call _%s", name);
+}
+
+// subq $size, %rsp
+static void emit_sub_rsp(int size) {
+    if (!output_object) {
+        println("  subq $%d, %%rsp", size);
+    } else if (size < 128) {
+        emit("\x48\x83\xec", 3);
+        emit_char(size);
+    } else {
+        emit("\x48\x81\xec", 3);
+        emit_u32(size);
+    }
+}
+
+// 引数のレジスタ reg の下位 size バイトを offset(%rbp) に格納します。
+static void emit_store_arg(Reg reg, int size, int offset) {
+    if (!output_object) {
+        if (size == 1)
+            println("  movb %s, %d(%%rbp)", argreg8[reg], offset);
+        else
+            println("  movq %s, %d(%%rbp)", argreg64[reg], offset);
+        return;
+    }
+
+    int code = argreg_code[reg];
+    if (size == 1) {
+        // REX がないと %dil と %sil は %bh と %dh になる
+        if (code >= 4)
+            emit_char(0x40 | (code >> 3) << 2);
+        emit_char(0x88);
+    } else {
+        emit_char(0x48 | (code >> 3) << 2);
+        emit_char(0x89);
+    }
+    emit_rbp_operand(code, offset);
+}
+
+// 関数の中のラベル。L_RETURN のほかは count() の番号ごとにある
+typedef enum { L_RETURN, L_ELSE, L_END, L_BEGIN } LabelKind;
+
+static char *label_names[] = {"return", "else", "end", "begin"};
+
+// 埋めていないジャンプ先。offset は 4 バイトの相対アドレスの位置
+typedef struct {
+    uint32_t offset;
+    int label;
+} Fixup;
+
+// 機械語に書いたラベルの関数の先頭からの位置。どのラベルもジャンプする
+// 関数の中で書くので、前の関数の値を消しておかなくてよい
+static _Thread_local uint32_t *label_pos;
+static _Thread_local int label_cap;
+static _Thread_local Fixup *fixups;
+static _Thread_local int nfixups;
+static _Thread_local int fixups_cap;
+
+static int label_id(LabelKind kind, int n) {
+    return kind == L_RETURN ? 0 : n * 3 + kind - 1;
+}
+
+static void emit_label_name(LabelKind kind, int n) {
+    emit_str(".L.");
+    emit_str(label_names[kind]);
+    emit_char('.');
+    emit_str(current_fn->name);
+    if (kind != L_RETURN) {
+        emit_char('.');
+        emit_int(n);
+    }
+}
+
+static void emit_label(LabelKind kind, int n) {
+    if (!output_object) {
+        emit_label_name(kind, n);
+        emit_line(":");
+        return;
+    }
+
+    int id = label_id(kind, n);
+    if (id >= label_cap) {
+        while (id >= label_cap)
+            label_cap = label_cap ? label_cap * 2 : 256;
+        label_pos = realloc(label_pos, sizeof(uint32_t) * label_cap);
+        if (!label_pos)
+            error("メモリ不足です");
+    }
+    label_pos[id] = output->len;
+}
+
+// jmp か、je でラベルへジャンプします。
+static void emit_jump(bool is_je, LabelKind kind, int n) {
+    if (!output_object) {
+        emit_str(is_je ? "  je  " : "  jmp ");
+        emit_label_name(kind, n);
+        emit_char('\n');
+        return;
+    }
+
+    if (is_je)
+        emit("\x0f\x84", 2);
+    else
+        emit_char(0xe9);
+    if (nfixups == fixups_cap) {
+        fixups_cap = fixups_cap ? fixups_cap * 2 : 256;
+        fixups = realloc(fixups, sizeof(Fixup) * fixups_cap);
+        if (!fixups)
+            error("メモリ不足です");
+    }
+    fixups[nfixups++] = (Fixup){output->len, label_id(kind, n)};
+    emit_u32(0);
 }
 
+// 関数を書き終えたら、ジャンプ先の相対アドレスを埋めます。
+static void resolve_jumps(void) {
+    for (int i = 0; i < nfixups; i++) {
+        Fixup *f = &fixups[i];
+        put_u32(output->buf + f->offset, label_pos[f->label] - (f->offset + 4));
+    }
+    nfixups = 0;
+}
+
+// 関数の中で一意なラベルの番号を返します。ラベルには関数名も付けるので、
+// どのスレッドがどの順で関数を生成しても同じ名前になる。
 static int count(void) {
-    static int i = 1;
-    return i++;
+    return ++nlabels;
 }
 
 static void push(void) {
-    if (depth >= MAX_STACK_DEPTH) {
-        error("スタックが深すぎます");
-    }
-    println("  pushq %%rax");
+    emit_insn(I_PUSH_RAX);
     depth++;
 }
 
-static void pop(char *arg) {
+static void pop(Reg reg) {
     if (depth <= 0) {
         error("スタックが空です");
     }
-    println("  popq %s", arg);
+    if (!output_object) {
+        emit_str("  popq ");
+        emit_line(argreg64[reg]);
+    } else {
+        int code = argreg_code[reg];
+        if (code >= 8)
+            emit_char(0x41);
+        emit_char(0x58 + (code & 7));
+    }
     depth--;
 }
 
@@ -45,27 +468,71 @@ static int align_to(int n, int align) {
     return (n + align - 1) / align * align;
 }
 
+// 木のたどり方。
+//
+// 機械が生成したソースでは式も文も数十万段に入れ子になることがあるので、
+// 木を再帰でたどらずに、作業用のスタック (frames) に積んだフレームを
+// 1 つずつ進める。フレームは再帰版の関数の呼び出し 1 回にあたり、step は
+// その関数の中のどの子の処理まで終えたかを表す。子をたどるときは step を
+// 進めてから子のフレームを積み、子が終われば親のフレームの続きから再開する。
+
+typedef enum {
+    GEN_EXPR, // 式の値を %rax に計算する
+    GEN_ADDR, // 左辺値のアドレスを %rax に計算する
+    GEN_STMT, // 文
+} GenKind;
+
+typedef struct {
+    GenKind kind;
+    int step;  // 終えた子の数
+    int label; // "if" と "for" のラベルの番号
+    Node *node;
+} Frame;
+
+static _Thread_local Frame *frames;
+static _Thread_local int nframes;
+static _Thread_local int frames_cap;
+
+// node をたどるフレームを積みます。積んだ後は、呼び出し側のフレームを指す
+// ポインタは使えない。
+static void visit(GenKind kind, Node *node) {
+    if (nframes == frames_cap) {
+        frames_cap = frames_cap ? frames_cap * 2 : 256;
+        frames = realloc(frames, sizeof(Frame) * frames_cap);
+        if (!frames)
+            error("メモリ不足です");
+    }
+    frames[nframes++] = (Frame){kind, 0, 0, node};
+}
+
+// 処理の最後に子をたどるだけなら、フレームを積まずにその子に置き換える
+static void tail_visit(Frame *f, GenKind kind, Node *node) {
+    *f = (Frame){kind, 0, 0, node};
+}
+
 // 指定されたノードの絶対アドレスを計算します。
 // 指定されたノードがメモリ内に存在しない場合はエラーになります。
-static void gen_addr(Node *node) {
+static void gen_addr(Frame *f) {
+    Node *node = f->node;
     switch (node->kind) {
     case ND_VAR:
         if (node->var->is_local) {
             // ローカル変数
-            println("  lea %d(%%rbp), %%rax", node->var->offset);
+            emit_lea_local(node->var->offset);
         } else {
             // グローバル関数
-            println("  lea %s(%%rip), %%rax", node->var->name);
+            emit_lea_global(node->var->name);
         }
+        nframes--;
         return;
     case ND_DEREF:
-        gen_expr(node->lhs);
+        tail_visit(f, GEN_EXPR, node->lhs);
         return;
     default:
         break;
     }
 
-    error_tok(node->tok, "not an lvalue");
+    error_at(node->loc, "not an lvalue");
 }
 
 // %rax が指している場所から値を読み込む。
@@ -74,242 +541,547 @@ static void load(Type *ty) {
         return;
     }
     if (ty->size == 1)
-        println("  movsbq (%%rax), %%rax");
+        emit_insn(I_LOAD8);
     else
-        println("  movq (%%rax), %%rax");
+        emit_insn(I_LOAD64);
 }
 
 // %rax をスタック先頭が指すアドレスに格納する。
 static void store(Type *ty) {
-    pop("%rdi");
+    pop(RDI);
 
     if (ty->size == 1)
-        println("  movb %%al, (%%rdi)");
+        emit_insn(I_STORE8);
     else
-        println("  movq %%rax, (%%rdi)");
+        emit_insn(I_STORE64);
 }
 
-static void gen_expr(Node *node) {
+static void gen_expr(Frame *f) {
+    Node *node = f->node;
+    int step = f->step++;
+
     switch (node->kind) {
     case ND_NUM:
-        println("  movq $%d, %%rax", node->val);
+        emit_mov_imm(node->val);
+        nframes--;
         return;
     case ND_NEG:
-        gen_expr(node->lhs);
-        println("  negq %%rax");
+        if (step == 0) {
+            visit(GEN_EXPR, node->lhs);
+            return;
+        }
+        emit_insn(I_NEG);
+        nframes--;
         return;
     case ND_VAR:
-        gen_addr(node);
+        if (step == 0) {
+            visit(GEN_ADDR, node);
+            return;
+        }
         load(node->ty);
+        nframes--;
         return;
     case ND_DEREF:
-        gen_expr(node->lhs);
+        if (step == 0) {
+            visit(GEN_EXPR, node->lhs);
+            return;
+        }
         load(node->ty);
+        nframes--;
         return;
     case ND_ADDR:
-        gen_addr(node->lhs);
+        tail_visit(f, GEN_ADDR, node->lhs);
         return;
     case ND_ASSIGN:
-        gen_addr(node->lhs);
-        push();
-        gen_expr(node->rhs);
+        if (step == 0) {
+            visit(GEN_ADDR, node->lhs);
+            return;
+        }
+        if (step == 1) {
+            push();
+            visit(GEN_EXPR, node->rhs);
+            return;
+        }
         store(node->ty);
+        nframes--;
         return;
     case ND_STMT_EXPR:
-        for (Node *n = node->body; n; n = n->next)
-            gen_stmt(n);
+        if (step < node->nbody) {
+            visit(GEN_STMT, node->body[step]);
+            return;
+        }
+        nframes--;
         return;
-    case ND_FUNCALL: {
-        int nargs = 0;
-        for (Node *arg = node->args; arg; arg = arg->next) {
-            gen_expr(arg);
+    case ND_FUNCALL:
+        // 引数を順に計算し、1 つ計算するごとに積む
+        if (step > 0)
             push();
-            nargs++;
+        if (step < node->nargs) {
+            visit(GEN_EXPR, node->args[step]);
+            return;
         }
 
-        for (int i = nargs - 1; i >= 0; i--)
-            pop(argreg64[i]);
+        for (int i = node->nargs - 1; i >= 0; i--)
+            pop(i);
 
-        println("  movq $0, %%rax");
-        println("  call _%s", node->funcname);
+        emit_mov_imm(0);
+        emit_call(node->funcname);
+        nframes--;
         return;
-    }
     default:
         break;
     }
 
     // 二項演算子
-    gen_expr(node->lhs);
-    push();
-    gen_expr(node->rhs);
-    pop("%rdi");
+    if (step == 0) {
+        visit(GEN_EXPR, node->lhs);
+        return;
+    }
+    if (step == 1) {
+        push();
+        visit(GEN_EXPR, node->rhs);
+        return;
+    }
+    pop(RDI);
+    nframes--;
 
     switch(node->kind) {
     case ND_ADD:
-        println("  addq %%rdi, %%rax");
+        emit_insn(I_ADD);
         return;
     case ND_SUB:
-        println("  subq %%rax, %%rdi");
-        println("  movq %%rdi, %%rax");
+        emit_insn(I_SUB);
+        emit_insn(I_MOV_RDI_RAX);
         return;
     case ND_MUL:
-        println("  imulq %%rdi, %%rax");
+        emit_insn(I_IMUL);
         return;
     case ND_DIV:
-        println("  movq %%rax, %%rcx");
-        println("  movq %%rdi, %%rax");
-        println("  cqo");
-        println("  idivq %%rcx");
+        emit_insn(I_MOV_RAX_RCX);
+        emit_insn(I_MOV_RDI_RAX);
+        emit_insn(I_CQO);
+        emit_insn(I_IDIV);
         return;
     case ND_EQ:
-        println("  cmpq %%rax, %%rdi");
-        println("  sete %%al");
-        println("  movzbq %%al, %%rax");
+        emit_insn(I_CMP);
+        emit_insn(I_SETE);
+        emit_insn(I_MOVZB);
         return;
     case ND_NE:
-        println("  cmpq %%rax, %%rdi");
-        println("  setne %%al");
-        println("  movzbq %%al, %%rax");
+        emit_insn(I_CMP);
+        emit_insn(I_SETNE);
+        emit_insn(I_MOVZB);
         return;
     case ND_LT:
-        println("  cmpq %%rax, %%rdi");
-        println("  setl %%al");
-        println("  movzbq %%al, %%rax");
+        emit_insn(I_CMP);
+        emit_insn(I_SETL);
+        emit_insn(I_MOVZB);
         return;
     case ND_LE:
-        println("  cmpq %%rax, %%rdi");
-        println("  setle %%al");
-        println("  movzbq %%al, %%rax");
+        emit_insn(I_CMP);
+        emit_insn(I_SETLE);
+        emit_insn(I_MOVZB);
         return;
     default:
-        return;
+        break;
     }
 
-    error_tok(node->tok, "invalid expression");
+    error_at(node->loc, "invalid expression");
 }
 
-static void gen_stmt(Node *node) {
+static void gen_stmt(Frame *f) {
+    Node *node = f->node;
+    int step = f->step++;
+
     switch (node->kind) {
     case ND_IF: {
-        int c = count();
-        gen_expr(node->cond);
-        println("  cmp $0, %%rax");
-        println("  je  .L.else.%d", c);
-        gen_stmt(node->then);
-        println("  jmp .L.end.%d", c);
-        println(".L.else.%d:", c);
-        if (node->els)
-            gen_stmt(node->els);
-        println(".L.end.%d:", c);
+        if (step == 0) {
+            f->label = count();
+            visit(GEN_EXPR, node->cond);
+            return;
+        }
+        int c = f->label;
+        if (step == 1) {
+            emit_insn(I_CMP_ZERO);
+            emit_jump(true, L_ELSE, c);
+            visit(GEN_STMT, node->then);
+            return;
+        }
+        if (step == 2) {
+            emit_jump(false, L_END, c);
+            emit_label(L_ELSE, c);
+            if (node->els) {
+                visit(GEN_STMT, node->els);
+                return;
+            }
+        }
+        emit_label(L_END, c);
+        nframes--;
         return;
     }
     case ND_FOR: {
-        int c = count();
-        if (node->init)
-            gen_stmt(node->init);
-        println(".L.begin.%d:", c);
-        if (node->cond) {
-            gen_expr(node->cond);
-            println("  cmp $0, %%rax");
-            println("  je  .L.end.%d", c);
+        if (step == 0) {
+            f->label = count();
+            if (node->init) {
+                visit(GEN_STMT, node->init);
+                return;
+            }
+            step = f->step++;
+        }
+        int c = f->label;
+        if (step == 1) {
+            emit_label(L_BEGIN, c);
+            if (node->cond) {
+                visit(GEN_EXPR, node->cond);
+                return;
+            }
+            step = f->step++;
+        }
+        if (step == 2) {
+            if (node->cond) {
+                emit_insn(I_CMP_ZERO);
+                emit_jump(true, L_END, c);
+            }
+            visit(GEN_STMT, node->then);
+            return;
+        }
+        if (step == 3 && node->inc) {
+            visit(GEN_EXPR, node->inc);
+            return;
         }
-        gen_stmt(node->then);
-        if (node->inc)
-            gen_expr(node->inc);
-        println("  jmp .L.begin.%d", c);
-        println(".L.end.%d:", c);
+        emit_jump(false, L_BEGIN, c);
+        emit_label(L_END, c);
+        nframes--;
         return;
     }
     case ND_BLOCK:
-        for (Node *n = node->body; n; n = n->next)
-            gen_stmt(n);
+        if (step < node->nbody) {
+            visit(GEN_STMT, node->body[step]);
+            return;
+        }
+        nframes--;
         return;
     case ND_RETURN:
-        gen_expr(node->lhs);
-        println("  jmp .L.return.%s", current_fn->name);
+        if (step == 0) {
+            visit(GEN_EXPR, node->lhs);
+            return;
+        }
+        emit_jump(false, L_RETURN, 0);
+        nframes--;
         return;
     case ND_EXPR_STMT:
-        gen_expr(node->lhs);
+        tail_visit(f, GEN_EXPR, node->lhs);
         return;
     default:
-        error_tok(node->tok, "invalid statement");
+        error_at(node->loc, "invalid statement");
     }
 }
 
-static void assign_lvar_offsets(Obj *prog) {
-    for (Obj *fn = prog; fn; fn = fn->next)
-    {
-        if (!fn->is_function)
-            continue;
-
-        int offset = 0;
-        for (Obj *var = fn->locals; var; var = var->next) {
-            offset += var->ty->size;
-            var->offset = -offset;
+// node から始めて、積んだフレームがなくなるまで進めます。
+static void gen(GenKind kind, Node *node) {
+    visit(kind, node);
+    while (nframes > 0) {
+        Frame *f = &frames[nframes - 1];
+        switch (f->kind) {
+        case GEN_EXPR:
+            gen_expr(f);
+            break;
+        case GEN_ADDR:
+            gen_addr(f);
+            break;
+        case GEN_STMT:
+            gen_stmt(f);
+            break;
         }
-        fn->stack_size = align_to(offset, 16);
-    } 
+    }
+}
+
+// ローカル変数のオフセットとスタックフレームの大きさを決めます。
+static void assign_lvar_offsets(Obj *fn) {
+    int offset = 0;
+    for (Obj *var = fn->locals; var; var = var->next) {
+        offset += var->ty->size;
+        var->offset = -offset;
+    }
+    fn->stack_size = align_to(offset, 16);
 }
 
 static void emit_data(Obj *prog) {
-    for (Obj *var =prog; var; var = var->next) {
+    for (Obj *var = prog; var; var = var->next) {
         if (var->is_function)
             continue;
 
-        println("  .data");                    // 以降を .data セクション（初期化済み/静的データ領域）として扱う
-        println("  .globl %s", var->name);     // このグローバル変数を他ファイルから参照可能にする
-        println("%s:", var->name);             // グローバル変数の先頭アドレスを示すラベルを定義
-        
+        if (output_object) {
+            elf_add_data(var->name, var->init_data, var->ty->size);
+            continue;
+        }
+
+        emit_line("  .data");                 // 以降を .data セクション（初期化済み/静的データ領域）として扱う
+        println("  .globl %s", var->name);    // このグローバル変数を他ファイルから参照可能にする
+        println("%s:", var->name);            // グローバル変数の先頭アドレスを示すラベルを定義
+
         if (var->init_data) {
-            for (int i = 0; i < var->ty->size; i++)
-                println("  .byte %d", var->init_data[i]);
+            for (int i = 0; i < var->ty->size; i++) {
+                emit_str("  .byte ");
+                emit_int(var->init_data[i]);
+                emit_char('\n');
+            }
         } else {
-            println("  .zero %d", var->ty->size);  // 変数サイズ分の領域を確保し、すべて 0 で初期化
+            println("  .zero %d", var->ty->size); // 変数サイズ分の領域を確保し、すべて 0 で初期化
         }
     }
 }
 
-static void emit_text(Obj *prog) {
-    for (Obj *fn = prog; fn; fn = fn->next)
-    {
-        if (!fn->is_function)
-            continue;
+// 関数 fn のコードを、このスレッドの出力に書きます。
+// 機械語なら、ラベルの位置を数えられるように出力は関数ごとのバッファにしておく。
+static void gen_function(Obj *fn) {
+    current_fn = fn;
+    nlabels = 0;
+    assign_lvar_offsets(fn);
 
+    // 前の関数の生成がエラーで打ち切られていれば、状態が残っている
+    nframes = depth = nfixups = 0;
+
+    if (!output_object) {
         println("  .globl _%s", fn->name); // この関数は外から参照可能とリンカに伝える
-        println("  .text");                // これ以降は命令コード（textセクション）
+        emit_line("  .text");              // これ以降は命令コード（textセクション）
         println("_%s:", fn->name);         // 関数の入口ラベル
-        current_fn = fn;
-
-        // 初期化処理
-        println("  pushq %%rbp");          // 呼び出し元の rbp をスタックに退避
-        println("  movq %%rsp, %%rbp");    // この関数のスタックフレームを確立
-        println("  subq $%d, %%rsp", fn->stack_size); // ローカル変数領域をまとめて確保
-
-        // レジスタ経由で渡された引数をスタックに保存する
-        int i = 0;
-        for (Obj *var = fn->params; var; var = var->next) {
-            if (var->ty->size == 1)
-                println("  movb %s, %d(%%rbp)", argreg8[i++], var->offset);
-            else
-                println("  movq %s, %d(%%rbp)", argreg64[i++], var->offset); // レジスタ渡しされた引数を、スタック上のローカル変数として保存
+    }
+
+    // 初期化処理
+    emit_insn(I_PUSH_RBP);           // 呼び出し元の rbp をスタックに退避
+    emit_insn(I_MOV_RSP_RBP);        // この関数のスタックフレームを確立
+    emit_sub_rsp(fn->stack_size);    // ローカル変数領域をまとめて確保
+
+    // レジスタ経由で渡された引数をスタックに保存する
+    int i = 0;
+    for (Obj *var = fn->params; var; var = var->next)
+        emit_store_arg(i++, var->ty->size, var->offset); // レジスタ渡しされた引数を、スタック上のローカル変数として保存
+
+    // コードを出力する
+    gen(GEN_STMT, fn->body);
+    assert(depth == 0);
+
+    // 終わり
+    emit_label(L_RETURN, 0);         //アセンブリのラベル
+    emit_insn(I_MOV_RBP_RSP);        // ローカル変数全部破棄
+    emit_insn(I_POP_RBP);            // 親のスタックフレームに戻る
+    emit_insn(I_RET);                // 呼び出し元へ帰る
+
+    if (output_object)
+        resolve_jumps();
+}
+
+// 関数 fn のコードを o のバッファに生成します。
+static void gen_buffer(Output *o, Obj *fn) {
+    *o = (Output){.fd = -1, .fn = fn};
+    Output *prev = output;
+    output = o;
+    gen_function(fn);
+    output = prev;
+}
+
+// 生成した関数のコードを出力に書き、バッファを解放します。主スレッドから呼ぶ。
+static void write_code(Output *code) {
+    if (output_object) {
+        elf_add_text(code->fn->name, code->buf, code->len, code->relocs, code->nrelocs);
+    } else if (file_output.cap - file_output.len >= code->len) {
+        memcpy(file_output.buf + file_output.len, code->buf, code->len);
+        file_output.len += code->len;
+    } else {
+        flush_output();
+        if (file_output.cap < code->len) {
+            write_all(file_output.fd, code->buf, code->len);
+        } else {
+            memcpy(file_output.buf, code->buf, code->len);
+            file_output.len = code->len;
         }
-            
-        // コードを出力する
-        gen_stmt(fn->body);
-        assert(depth == 0);
+    }
+    free(code->buf);
+    free(code->relocs);
+}
+
+//
+// 関数ごとの並列なコード生成
+//
+// 関数が多い入力では、ワーカースレッドが関数ごとに別のバッファへコードを
+// 生成し、主スレッドがそれをソースの順に出力ファイルへ書き出す。ラベルの
+// 番号は関数ごとに数えるので、出力はスレッドの数によらず同じになる。
+// エラーは、1 スレッドで生成した場合に最初に見つかる関数のものを
+// 主スレッドが報告する。
+//
+
+// 並列に生成するのは、この数より多くの関数がある入力だけ
+#define PARALLEL_MIN_FUNCS 64
+
+// 1 スレッドあたり、書き出していない関数をいくつまで先に生成しておくか
+#define JOBS_AHEAD 16
+
+typedef struct {
+    Obj *fn;
+    Output out;
+    ErrorTrap error;
+    bool failed;
+    bool done;
+} GenJob;
+
+static GenJob *jobs;
+static int njobs;
+static int nworkers;
+static int next_job; // 次にワーカーが受け持つ関数
+static int written;  // 主スレッドが書き出し終えた関数の数
 
-        // 終わり
-        println(".L.return.%s:", fn->name); //アセンブリのラベル
-        println("  movq %%rbp, %%rsp");     // ローカル変数全部破棄
-        println("  popq %%rbp");            // 親のスタックフレームに戻る
-        println("  ret");                   // 呼び出し元へ帰る
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+
+static void run_job(GenJob *job) {
+    error_trap = &job->error;
+    if (setjmp(job->error.jmp))
+        job->failed = true;
+    else
+        gen_buffer(&job->out, job->fn);
+    error_trap = NULL;
+}
+
+static void *codegen_worker(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&job_lock);
+    for (;;) {
+        while (next_job < njobs && next_job >= written + nworkers * JOBS_AHEAD)
+            pthread_cond_wait(&job_cond, &job_lock);
+        if (next_job == njobs)
+            break;
+
+        GenJob *job = &jobs[next_job++];
+        pthread_mutex_unlock(&job_lock);
+        run_job(job);
+        pthread_mutex_lock(&job_lock);
+
+        job->done = true;
+        pthread_cond_broadcast(&job_cond);
     }
+    pthread_mutex_unlock(&job_lock);
+
+    codegen_free_thread();
+    return NULL;
 }
 
-void codegen(Obj *prog, FILE *out) {
-    output_file = out;
-    
-    assign_lvar_offsets(prog);
+static void emit_text(Obj *prog) {
+    int nfuncs = 0;
+    for (Obj *fn = prog; fn; fn = fn->next)
+        if (fn->is_function)
+            nfuncs++;
+
+    // prog は新しいものが先頭なので、後ろから詰めてソースの順にする
+    jobs = calloc(nfuncs, sizeof(GenJob));
+    if (!jobs)
+        error("メモリ不足です");
+    njobs = nfuncs;
+    next_job = written = 0;
+    for (Obj *fn = prog; fn; fn = fn->next)
+        if (fn->is_function)
+            jobs[--nfuncs].fn = fn;
+
+    nworkers = thread_count();
+    if (nworkers <= 1 || njobs <= PARALLEL_MIN_FUNCS) {
+        for (int i = 0; i < njobs; i++)
+            codegen_function(jobs[i].fn);
+        free(jobs);
+        jobs = NULL;
+        return;
+    }
+
+    pthread_t *workers = calloc(nworkers, sizeof(pthread_t));
+    for (int i = 0; i < nworkers; i++)
+        if (pthread_create(&workers[i], NULL, codegen_worker, NULL))
+            error("cannot create thread: %s", strerror(errno));
+
+    // 生成し終えた関数から、ソースの順に書き出す
+    for (int i = 0; i < njobs; i++) {
+        GenJob *job = &jobs[i];
+        pthread_mutex_lock(&job_lock);
+        while (!job->done)
+            pthread_cond_wait(&job_cond, &job_lock);
+        pthread_mutex_unlock(&job_lock);
+
+        if (job->failed)
+            error_at(job->error.loc, "%s", job->error.msg ? job->error.msg : "メモリ不足です");
+        write_code(&job->out);
+
+        pthread_mutex_lock(&job_lock);
+        written++;
+        pthread_cond_broadcast(&job_cond);
+        pthread_mutex_unlock(&job_lock);
+    }
+
+    for (int i = 0; i < nworkers; i++)
+        pthread_join(workers[i], NULL);
+    free(workers);
+    free(jobs);
+    jobs = NULL;
+}
+
+void codegen_begin(FILE *out) {
+    fflush(out);
+    file_output.fd = fileno(out);
+    file_output.len = 0;
+    file_output.cap = OUTPUT_BUF_SIZE;
+    if (!file_output.buf)
+        file_output.buf = malloc(OUTPUT_BUF_SIZE);
+    if (!file_output.buf)
+        error("メモリ不足です");
+    output = &file_output;
+    if (output_object)
+        elf_begin();
+}
+
+// 関数 fn のコードを出力に書きます。主スレッドから呼ぶ。
+void codegen_function(Obj *fn) {
+    if (output_object)
+        codegen_write(codegen_buffer(fn));
+    else
+        gen_function(fn);
+}
+
+// 関数 fn のコードを新しいバッファに生成して返します。どのスレッドからも呼べる。
+Output *codegen_buffer(Obj *fn) {
+    Output *code = malloc(sizeof(Output));
+    if (!code)
+        error("メモリ不足です");
+    gen_buffer(code, fn);
+    return code;
+}
+
+// codegen_buffer() が生成したコードを出力に書き、解放します。主スレッドから呼ぶ。
+void codegen_write(Output *code) {
+    write_code(code);
+    free(code);
+}
+
+// このスレッドのコード生成の作業領域を解放します。
+// codegen_buffer() を呼んだワーカースレッドは終了する前に呼ぶ。
+void codegen_free_thread(void) {
+    free(frames);
+    free(label_pos);
+    free(fixups);
+    frames = NULL;
+    label_pos = NULL;
+    fixups = NULL;
+    nframes = frames_cap = label_cap = nfixups = fixups_cap = 0;
+}
+
+// 大域変数と文字列リテラルを書き、出力を書き出し終えます。
+// 関数のコードは codegen_function() か codegen_buffer() で生成し終えていること。
+void codegen_end(Obj *prog) {
     emit_data(prog);
+    if (output_object)
+        elf_write(file_output.fd);
+    else
+        flush_output();
+}
+
+void codegen(Obj *prog, FILE *out) {
+    codegen_begin(out);
     emit_text(prog);
+    codegen_end(prog);
 }
@@ -4,16 +4,43 @@
 #include <errno.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <setjmp.h>
+#include <stdint.h>
 
 typedef struct Type Type;
 typedef struct Node Node;
 
 // string.c
 char *format(char *fmt, ...);
+char *intern(char *p, int len);
+extern bool intern_threaded;
+
+// arena.c
+
+// アリーナから確保するものの種類。種類ごとに確保したバイト数を数える。
+typedef enum {
+    ARENA_NODE,
+    ARENA_TYPE,
+    ARENA_OBJ,
+    ARENA_STR,
+    ARENA_NKINDS,
+} ArenaKind;
+
+typedef struct Arena Arena;
+
+void *arena_alloc(ArenaKind kind, size_t size);
+Arena *arena_new(void);
+void arena_free(Arena *arena);
+Arena *arena_use(Arena *arena);
+char *arena_format(char *fmt, ...);
+void arena_flush_stats(void);
+void arena_release(void);
+void print_arena_stats(FILE *out);
 
 // tokenize.c
 
@@ -27,19 +54,147 @@ typedef enum {
     TK_EOF,      // 入力の終わりを表すトークン
 } TokenKind;
 
+// 記号とキーワードの ID。
+// トークナイザが割り当て、パーサは文字列ではなくこの ID で記号を判定する。
+typedef enum {
+    ID_NONE,      // 識別子など、ID を持たないトークン
+    // 記号
+    P_EQ,         // ==
+    P_NE,         // !=
+    P_LE,         // <=
+    P_GE,         // >=
+    P_LT,         // <
+    P_GT,         // >
+    P_ASSIGN,     // =
+    P_PLUS,       // +
+    P_MINUS,      // -
+    P_STAR,       // *
+    P_SLASH,      // /
+    P_AMP,        // &
+    P_LPAREN,     // (
+    P_RPAREN,     // )
+    P_LBRACE,     // {
+    P_RBRACE,     // }
+    P_LBRACKET,   // [
+    P_RBRACKET,   // ]
+    P_COMMA,      // ,
+    P_SEMICOLON,  // ;
+    P_NOT,        // !
+    P_TILDE,      // ~
+    P_PERCENT,    // %
+    P_PIPE,       // |
+    P_CARET,      // ^
+    P_QUESTION,   // ?
+    P_COLON,      // :
+    P_ANDAND,     // &&
+    P_OROR,       // ||
+    P_SHL,        // <<
+    P_SHR,        // >>
+    P_HASH,       // #
+    P_HASHHASH,   // ##
+    // キーワード
+    KW_RETURN,    // return
+    KW_IF,        // if
+    KW_ELSE,      // else
+    KW_FOR,       // for
+    KW_WHILE,     // while
+    KW_INT,       // int
+    KW_CHAR,      // char
+    KW_SIZEOF,    // sizeof
+} TokenId;
+
 typedef struct Token Token;
 
+// トークンは 1 つの配列に連続して格納され、次のトークンは tok + 1 にある。
+// 文字列リテラルの内容は別の表 (StrLit) に置き、トークンには添字だけを持たせる。
 struct Token {
-    TokenKind kind; // トークンの型
-    Token *next;    // 整数トークン
-    Type *ty;       // 型、例えば int や int へのポインタ（TK_STR の場合にも使用）
-    char *loc;      // kind が TK_NUM の場合、その数値
-    int len;        // トークンの長さ
-    char *str;      // 終端の '\0' を含む文字列リテラルの内容
-    int val;        // 数値の場合の値
+    char *loc;          // トークンの位置
+    int len;            // トークンの長さ
+    unsigned char kind; // トークンの型 (TokenKind)
+    unsigned char id;   // 記号またはキーワードの ID (TokenId)
+    bool at_bol : 1;    // 行頭のトークンなら true
+    bool has_space : 1; // 直前に空白かコメントがあれば true
+    bool no_expand : 1; // マクロとして展開しない
+    union {
+        int val;    // kind が TK_NUM の場合、その数値
+        int str;    // kind が TK_STR の場合、文字列リテラル表の添字
+        char *name; // kind が TK_IDENT の場合、識別子のアトム
+    };
 };
 
-extern char *user_input;
+// 文字列リテラル
+typedef struct {
+    char *str;      // 終端の '\0' を含む文字列リテラルの内容
+    int len;        // 終端の '\0' を含む長さ
+} StrLit;
+
+// トークンと文字列リテラルの可変長配列。
+// トークンの str は同じ TokenBuf の strs の添字になる。
+typedef struct {
+    Token *toks;
+    int len;
+    int cap;
+    StrLit *strs;
+    int nstrs;
+    int strs_cap;
+} TokenBuf;
+
+extern int peak_tokens;
+extern int num_threads;
+
+// 入力バッファの末尾に置く 0 のバイト数。
+// 走査カーネルが終端を越えてまとめて読み込んでも安全なようにする。
+#define INPUT_PADDING 64
+
+// source.c
+
+// 入力ファイル
+typedef struct {
+    char *name;       // ファイル名
+    char *contents;   // 内容。後ろに INPUT_PADDING バイトの 0 が続く
+    size_t size;      // 内容の長さ
+    int index;        // 読み込んだ順の番号
+
+    // 各行の先頭のオフセット。最初に行番号を求めるときに作る
+    size_t *line_starts;
+    int nlines;
+} File;
+
+File *load_file(char *path);
+File **get_files(int *len);
+File *find_file(char *loc);
+void get_location(File *file, char *loc, int *line_no, int *col_no);
+void verror_at(char *loc, char *fmt, va_list ap);
+
+// エラーを表示して終了する代わりに、そのスレッドで jmp へ戻るための罠。
+// msg は malloc() した領域で、メッセージを作れなかった場合は NULL
+typedef struct {
+    jmp_buf jmp;
+    char *loc;
+    char *msg;
+} ErrorTrap;
+
+extern _Thread_local ErrorTrap *error_trap;
+
+// preprocess.c
+
+extern int nheaders_read;
+extern int nheaders_cached;
+extern int nheaders_skipped;
+void add_include_path(char *dir);
+void init_preprocess(File *file);
+Token *preprocess(TokenBuf *out);
+
+// scan.c
+
+extern char *(*skip_space)(char *p);
+extern char *(*skip_ident)(char *p);
+extern char *(*skip_digits)(char *p);
+extern char *(*find_line_end)(char *p);
+extern char *(*find_comment_end)(char *p);
+extern char *(*find_string_special)(char *p);
+bool set_scan_isa(char *isa);
+void init_scan(void);
 
 // parse.c
 
@@ -47,7 +202,7 @@ extern char *user_input;
 typedef struct Obj Obj;
 struct Obj {
     Obj *next;
-    char *name;    // 変数名
+    char *name;    // 変数名（識別子ならアトム）
     Type *ty;      // 型
     bool is_local; // ローカル、またはグローバル/関数
 
@@ -93,33 +248,47 @@ typedef enum {
     ND_NUM,       // 整数
 } NodeKind;
 
-// 抽象構文木のノードの型
+// 抽象構文木のノードの型。
+// 共通部分の後ろに種類ごとの内容を共用体で置く。new_node() は種類に
+// 必要な大きさだけを確保するので、その種類が使わないメンバは読めない。
 struct Node {
     NodeKind kind; // ノードの型
-    Node *next;    // 次のノード
-    Token *tok;    // 代表トークン
-    Type *ty;      // 式の型
-    Node *lhs;     // 左辺
-    Node *rhs;     // 右辺
-    // "if"
-    Node *cond;
-    Node *then;
-    Node *els;
-    // "for"
-    Node *init;
-    Node *inc;
-    //block か　ステートメント式（複数の文）
-    Node *body;
-    // Function call
-    char *funcname;
-    Node *args;
-    
     int val;       // kindがND_NUMの場合のみ使う
-    Obj *var;      // kindがND_VARの場合のみ使う
-    int offset;    // kindがND_LVARの場合のみ使う
+    char *loc;     // 代表トークンの位置
+    Type *ty;      // 式の型
+    union {
+        // 演算子、"return"、式文。単項なら lhs だけを持つ
+        struct {
+            Node *lhs; // 左辺
+            Node *rhs; // 右辺
+        };
+        // "if" と "for"
+        struct {
+            Node *cond;
+            Node *then;
+            union {
+                Node *els;  // "if"
+                Node *init; // "for"
+            };
+            Node *inc;      // "for"
+        };
+        // block か　ステートメント式（複数の文）
+        struct {
+            Node **body;
+            int nbody;
+        };
+        // Function call
+        struct {
+            char *funcname; // 関数名のアトム
+            Node **args;
+            int nargs;
+        };
+        Obj *var;      // kindがND_VARの場合のみ使う
+    };
 };
 
-Obj *parse(Token *tok);
+size_t node_size(NodeKind kind);
+Obj *parse(bool stream);
 
 // type.c
 
@@ -131,6 +300,9 @@ typedef enum {
     TY_ARRAY,
 } TypeKind;
 
+// 型。派生型は pointer_to() などが正準化して返すので、同じ構造の型は
+// 同じオブジェクトになり、ポインタを比べれば等しいかどうか分かる。
+// 共有されるので、作った後で書き換えてはいけない。
 struct Type {
     TypeKind kind;
 
@@ -138,36 +310,76 @@ struct Type {
     int size;   // sizeof()
     Type *base;
 
-    // 宣言
-    Token *name;
-
     // 配列
     int array_len;
 
     // 関数の型
     Type *return_ty;
-    Type *params;
-    Type *next;
+    Type **params;
+    int nparams;
 };
 
 extern Type *ty_char;
 extern Type *ty_int;
 
 bool is_integer(Type *ty);
-Type *copy_type(Type *ty);
+void reset_types(void);
+Type *canonical_type(Type *ty);
 Type *pointer_to(Type *base);
-Type *func_type(Type *return_ty);
+Type *func_type(Type *return_ty, Type **params, int nparams);
 Type *array_of(Type *base, int len);
 void add_type(Node *node);
 
+// ast.c
+
+void emit_ast(Obj *prog, char *path);
+Obj *load_ast(char *path);
+
 // codegen.c
 
 void error(char *fmt, ...);
 void error_at(char *loc, char *fmt, ...);
 void error_tok(Token *tok, char *fmt, ...);
 bool equal(Token *tok, char *op);
-Token *skip(Token *tok, char *op);
-bool consume(Token **rest, Token *tok, char *str);
-Token *tokenize_file(char *filename);
-Obj *parse(Token *tok);
+Token *skip(Token *tok, TokenId id);
+bool consume(Token **rest, Token *tok, TokenId id);
+void tokenize_file(char *filename);
+TokenBuf *tokenize_batch(void);
+void tokenize_buffer(TokenBuf *buf, char *p);
+Token *copy_token(TokenBuf *dst, Token *tok, TokenBuf *src);
+Token *tokenize_next(void);
+int thread_count(void);
+StrLit *get_str_lit(Token *tok);
+void set_parse_buf(TokenBuf *buf);
+void save_tokens(TokenBuf *buf, Token *tok);
+// 生成したコード。codegen_buffer() が返し、codegen_write() が解放する
+typedef struct Output Output;
+
+extern bool output_object;
+
+void write_all(int fd, char *p, size_t len);
+void codegen_begin(FILE *out);
+void codegen_function(Obj *fn);
+Output *codegen_buffer(Obj *fn);
+void codegen_write(Output *code);
+void codegen_free_thread(void);
+void codegen_end(Obj *prog);
 void codegen(Obj *prog, FILE *out);
+
+// elf.c
+
+#define R_X86_64_PC32 2
+#define R_X86_64_PLT32 4
+
+// 関数のコードの中で、リンク時にシンボルのアドレスで埋める場所。
+// 埋める値は場所の終わりからの相対アドレス
+typedef struct {
+    uint32_t offset; // 関数の先頭からの位置
+    int type;        // R_X86_64_PC32 など
+    char *name;      // シンボルの名前
+} Reloc;
+
+void elf_begin(void);
+void elf_add_text(char *name, char *code, size_t len, Reloc *relocs, int nrelocs);
+void elf_add_data(char *name, char *init_data, int size);
+void elf_write(int fd);
@@ -0,0 +1,362 @@
+// ELF のオブジェクトファイルの書き出し。
+//
+// -c では codegen.c が関数ごとに機械語と再配置を組み立て、ここで .text と
+// .data のセクション、シンボル表、再配置表を持つ x86-64 の ELF64
+// リロケータブルオブジェクトにまとめる。アセンブラを起動しないので、
+// アセンブリのテキストを書いて読み直す手間がかからない。
+//
+// シンボルの名前は ELF の慣習どおり C の名前そのままで、アセンブリの
+// 出力のように "_" を付けない。".L" で始まる文字列リテラルはローカルな
+// シンボルにする。
+//
+// 構造体はこのコンパイラが動く x86-64 のリトルエンディアンのレイアウトで
+// そのまま書き出す。macOS には <elf.h> がないので、必要な定義はここに置く。
+
+#include "compiler.h"
+
+#define SHT_PROGBITS 1
+#define SHT_SYMTAB 2
+#define SHT_STRTAB 3
+#define SHT_RELA 4
+
+#define SHF_WRITE 0x1
+#define SHF_ALLOC 0x2
+#define SHF_EXECINSTR 0x4
+#define SHF_INFO_LINK 0x40
+
+#define STB_LOCAL 0
+#define STB_GLOBAL 1
+#define STT_NOTYPE 0
+#define STT_OBJECT 1
+#define STT_FUNC 2
+
+// セクションの番号
+enum {
+    SEC_NULL,
+    SEC_TEXT,
+    SEC_DATA,
+    SEC_SYMTAB,
+    SEC_STRTAB,
+    SEC_RELA_TEXT,
+    SEC_SHSTRTAB,
+    SEC_NOTE_STACK,
+    NSECTIONS,
+};
+
+typedef struct {
+    unsigned char e_ident[16];
+    uint16_t e_type;
+    uint16_t e_machine;
+    uint32_t e_version;
+    uint64_t e_entry;
+    uint64_t e_phoff;
+    uint64_t e_shoff;
+    uint32_t e_flags;
+    uint16_t e_ehsize;
+    uint16_t e_phentsize;
+    uint16_t e_phnum;
+    uint16_t e_shentsize;
+    uint16_t e_shnum;
+    uint16_t e_shstrndx;
+} ElfHeader;
+
+typedef struct {
+    uint32_t sh_name;
+    uint32_t sh_type;
+    uint64_t sh_flags;
+    uint64_t sh_addr;
+    uint64_t sh_offset;
+    uint64_t sh_size;
+    uint32_t sh_link;
+    uint32_t sh_info;
+    uint64_t sh_addralign;
+    uint64_t sh_entsize;
+} SectionHeader;
+
+typedef struct {
+    uint32_t st_name;
+    unsigned char st_info;
+    unsigned char st_other;
+    uint16_t st_shndx;
+    uint64_t st_value;
+    uint64_t st_size;
+} ElfSym;
+
+typedef struct {
+    uint64_t r_offset;
+    uint64_t r_info;
+    int64_t r_addend;
+} ElfRela;
+
+// 伸ばしながら書き足すバイト列
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} Buf;
+
+static void buf_reserve(Buf *b, size_t len) {
+    if (b->cap - b->len >= len)
+        return;
+    while (b->cap - b->len < len)
+        b->cap = b->cap ? b->cap * 2 : 4096;
+    b->data = realloc(b->data, b->cap);
+    if (!b->data)
+        error("メモリ不足です");
+}
+
+static size_t buf_add(Buf *b, void *p, size_t len) {
+    buf_reserve(b, len);
+    size_t off = b->len;
+    memcpy(b->data + off, p, len);
+    b->len += len;
+    return off;
+}
+
+static void buf_zero(Buf *b, size_t len) {
+    buf_reserve(b, len);
+    memset(b->data + b->len, 0, len);
+    b->len += len;
+}
+
+// シンボル。名前は strtab に置く
+typedef struct {
+    uint32_t name;  // strtab の中の位置
+    int type;       // STT_*
+    int shndx;      // 定義したセクション。未定義なら SEC_NULL
+    uint64_t value; // セクションの先頭からの位置
+    uint64_t size;
+    int index;      // シンボル表での番号。書き出すときに決める
+} Symbol;
+
+static Buf text;
+static Buf data;
+static Buf strtab;
+static Buf rela; // ElfRela の r_info には syms の添字を入れておく
+
+static Symbol *syms;
+static int nsyms;
+static int syms_cap;
+
+// 名前から syms の添字を引くオープンアドレス法のハッシュ表。
+// 値は添字 + 1 で、0 なら空き。容量は常に 2 のべき乗。
+static int *sym_table;
+static int sym_table_cap;
+
+static uint32_t hash_name(char *name) {
+    uint32_t h = 2166136261;
+    for (char *p = name; *p; p++)
+        h = (h ^ (unsigned char)*p) * 16777619;
+    return h;
+}
+
+static int *sym_slot(char *name) {
+    for (uint32_t i = hash_name(name);; i++) {
+        int *slot = &sym_table[i & (sym_table_cap - 1)];
+        if (!*slot || !strcmp(strtab.data + syms[*slot - 1].name, name))
+            return slot;
+    }
+}
+
+static void grow_sym_table(void) {
+    free(sym_table);
+    sym_table_cap = sym_table_cap ? sym_table_cap * 2 : 256;
+    sym_table = calloc(sym_table_cap, sizeof(int));
+    if (!sym_table)
+        error("メモリ不足です");
+    for (int i = 0; i < nsyms; i++)
+        *sym_slot(strtab.data + syms[i].name) = i + 1;
+}
+
+// name のシンボルの添字を返します。なければ未定義のシンボルとして作る。
+static int find_symbol(char *name) {
+    if ((nsyms + 1) * 2 > sym_table_cap)
+        grow_sym_table();
+
+    int *slot = sym_slot(name);
+    if (*slot)
+        return *slot - 1;
+
+    if (nsyms == syms_cap) {
+        syms_cap = syms_cap ? syms_cap * 2 : 256;
+        syms = realloc(syms, sizeof(Symbol) * syms_cap);
+        if (!syms)
+            error("メモリ不足です");
+    }
+    syms[nsyms] = (Symbol){.name = buf_add(&strtab, name, strlen(name) + 1)};
+    *slot = ++nsyms;
+    return nsyms - 1;
+}
+
+static void define_symbol(char *name, int type, int shndx, uint64_t value, uint64_t size) {
+    int i = find_symbol(name);
+    Symbol *sym = &syms[i];
+    if (sym->shndx != SEC_NULL)
+        error("symbol already defined: %s", name);
+    sym->type = type;
+    sym->shndx = shndx;
+    sym->value = value;
+    sym->size = size;
+}
+
+static bool is_local(Symbol *sym) {
+    return !strncmp(strtab.data + sym->name, ".L", 2);
+}
+
+void elf_begin(void) {
+    text.len = data.len = strtab.len = rela.len = 0;
+    nsyms = 0;
+    if (sym_table)
+        memset(sym_table, 0, sizeof(int) * sym_table_cap);
+
+    // 名前の位置 0 は空の名前
+    buf_zero(&strtab, 1);
+}
+
+// 関数 name のコードを .text の末尾に置きます。relocs の位置は code の先頭から数える。
+void elf_add_text(char *name, char *code, size_t len, Reloc *relocs, int nrelocs) {
+    uint64_t base = buf_add(&text, code, len);
+    define_symbol(name, STT_FUNC, SEC_TEXT, base, len);
+
+    for (int i = 0; i < nrelocs; i++) {
+        Reloc *r = &relocs[i];
+        uint64_t sym = find_symbol(r->name);
+        ElfRela e = {base + r->offset, sym << 32 | r->type, -4};
+        buf_add(&rela, &e, sizeof(e));
+    }
+}
+
+// 大域変数か文字列リテラル name を .data の末尾に置きます。
+// init_data が NULL なら 0 で埋める。
+void elf_add_data(char *name, char *init_data, int size) {
+    uint64_t off = data.len;
+    if (init_data)
+        buf_add(&data, init_data, size);
+    else
+        buf_zero(&data, size);
+    define_symbol(name, STT_OBJECT, SEC_DATA, off, size);
+}
+
+static size_t align_up(size_t n, size_t align) {
+    return (n + align - 1) / align * align;
+}
+
+// 出力の位置を off まで 0 で埋めて進めます。
+static void write_padding(int fd, size_t *pos, size_t off) {
+    static char zero[8];
+    write_all(fd, zero, off - *pos);
+    *pos = off;
+}
+
+// オブジェクトファイルを fd に書き出します。
+void elf_write(int fd) {
+    // シンボル表にはローカルなシンボルを先に並べる。番号 0 は空のシンボル
+    Buf symtab = {0};
+    buf_zero(&symtab, sizeof(ElfSym));
+    int nlocal = 1;
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < nsyms; i++) {
+            Symbol *sym = &syms[i];
+            bool local = sym->shndx != SEC_NULL && is_local(sym);
+            if (local != (pass == 0))
+                continue;
+
+            sym->index = symtab.len / sizeof(ElfSym);
+            ElfSym e = {
+                .st_name = sym->name,
+                .st_info = (local ? STB_LOCAL : STB_GLOBAL) << 4 | sym->type,
+                .st_shndx = sym->shndx,
+                .st_value = sym->value,
+                .st_size = sym->size,
+            };
+            buf_add(&symtab, &e, sizeof(e));
+            if (local)
+                nlocal++;
+        }
+    }
+
+    // 再配置のシンボルを、シンボル表での番号に置き換える
+    ElfRela *relas = (ElfRela *)rela.data;
+    int nrelas = rela.len / sizeof(ElfRela);
+    for (int i = 0; i < nrelas; i++) {
+        Symbol *sym = &syms[relas[i].r_info >> 32];
+        relas[i].r_info = (uint64_t)sym->index << 32 | (uint32_t)relas[i].r_info;
+    }
+
+    Buf shstrtab = {0};
+    buf_zero(&shstrtab, 1);
+    SectionHeader sh[NSECTIONS] = {0};
+    sh[SEC_TEXT].sh_name = buf_add(&shstrtab, ".text", 6);
+    sh[SEC_DATA].sh_name = buf_add(&shstrtab, ".data", 6);
+    sh[SEC_SYMTAB].sh_name = buf_add(&shstrtab, ".symtab", 8);
+    sh[SEC_STRTAB].sh_name = buf_add(&shstrtab, ".strtab", 8);
+    sh[SEC_RELA_TEXT].sh_name = buf_add(&shstrtab, ".rela.text", 11);
+    sh[SEC_SHSTRTAB].sh_name = buf_add(&shstrtab, ".shstrtab", 10);
+    sh[SEC_NOTE_STACK].sh_name = buf_add(&shstrtab, ".note.GNU-stack", 16);
+
+    // ヘッダの後ろにセクションの中身を並べ、最後にセクションヘッダの表を置く
+    size_t off = sizeof(ElfHeader);
+    struct {
+        int sec;
+        Buf *buf;
+        uint32_t type;
+        uint64_t flags;
+        uint64_t align;
+        uint64_t entsize;
+    } layout[] = {
+        {SEC_TEXT, &text, SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR, 1, 0},
+        {SEC_DATA, &data, SHT_PROGBITS, SHF_ALLOC | SHF_WRITE, 1, 0},
+        {SEC_SYMTAB, &symtab, SHT_SYMTAB, 0, 8, sizeof(ElfSym)},
+        {SEC_STRTAB, &strtab, SHT_STRTAB, 0, 1, 0},
+        {SEC_RELA_TEXT, &rela, SHT_RELA, SHF_INFO_LINK, 8, sizeof(ElfRela)},
+        {SEC_SHSTRTAB, &shstrtab, SHT_STRTAB, 0, 1, 0},
+    };
+    int nlayout = sizeof(layout) / sizeof(*layout);
+    for (int i = 0; i < nlayout; i++) {
+        SectionHeader *s = &sh[layout[i].sec];
+        off = align_up(off, layout[i].align);
+        s->sh_type = layout[i].type;
+        s->sh_flags = layout[i].flags;
+        s->sh_offset = off;
+        s->sh_size = layout[i].buf->len;
+        s->sh_addralign = layout[i].align;
+        s->sh_entsize = layout[i].entsize;
+        off += layout[i].buf->len;
+    }
+    sh[SEC_SYMTAB].sh_link = SEC_STRTAB;
+    sh[SEC_SYMTAB].sh_info = nlocal;
+    sh[SEC_RELA_TEXT].sh_link = SEC_SYMTAB;
+    sh[SEC_RELA_TEXT].sh_info = SEC_TEXT;
+
+    // スタックを実行可能にしなくてよいことをリンカに伝える空のセクション
+    sh[SEC_NOTE_STACK].sh_type = SHT_PROGBITS;
+    sh[SEC_NOTE_STACK].sh_offset = off;
+    sh[SEC_NOTE_STACK].sh_addralign = 1;
+
+    size_t shoff = align_up(off, 8);
+    ElfHeader eh = {
+        .e_ident = {0x7f, 'E', 'L', 'F', 2, 1, 1}, // 64 ビット、リトルエンディアン
+        .e_type = 1,     // ET_REL
+        .e_machine = 62, // EM_X86_64
+        .e_version = 1,
+        .e_shoff = shoff,
+        .e_ehsize = sizeof(ElfHeader),
+        .e_shentsize = sizeof(SectionHeader),
+        .e_shnum = NSECTIONS,
+        .e_shstrndx = SEC_SHSTRTAB,
+    };
+
+    size_t pos = 0;
+    write_all(fd, (char *)&eh, sizeof(eh));
+    pos += sizeof(eh);
+    for (int i = 0; i < nlayout; i++) {
+        write_padding(fd, &pos, sh[layout[i].sec].sh_offset);
+        write_all(fd, layout[i].buf->data, layout[i].buf->len);
+        pos += layout[i].buf->len;
+    }
+    write_padding(fd, &pos, shoff);
+    write_all(fd, (char *)sh, sizeof(sh));
+
+    free(symtab.data);
+    free(shstrtab.data);
+}
@@ -3,11 +3,15 @@
 #include "compiler.h"
 
 static char *opt_o;
+static bool opt_stats;
+static char *opt_emit_ast;
+static char *opt_load_ast;
 
 static char *input_path;
 
 static void usage(int status) {
-    fprintf(stderr, "a.out [-o <path> ] <file>\n");
+    fprintf(stderr, "a.out [-c] [-o <path> ] [-I <dir>] [--stats] [--threads=<n>] [--emit-ast=<path>] <file>\n");
+    fprintf(stderr, "a.out [-c] [-o <path> ] [--stats] --load-ast=<path>\n");
     exit(status);
 }
 
@@ -16,6 +20,35 @@ static void parse_args(int argc, char **argv) {
         if (!strcmp(argv[i], "--help"))
             usage(0);
 
+        // アセンブリの代わりに ELF のオブジェクトファイルを書く
+        if (!strcmp(argv[i], "-c")) {
+            output_object = true;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "--stats")) {
+            opt_stats = true;
+            continue;
+        }
+
+        if (!strncmp(argv[i], "--threads=", 10)) {
+            char *end;
+            num_threads = strtol(argv[i] + 10, &end, 10);
+            if (*end || num_threads < 1)
+                error("invalid thread count: %s", argv[i] + 10);
+            continue;
+        }
+
+        if (!strncmp(argv[i], "--emit-ast=", 11)) {
+            opt_emit_ast = argv[i] + 11;
+            continue;
+        }
+
+        if (!strncmp(argv[i], "--load-ast=", 11)) {
+            opt_load_ast = argv[i] + 11;
+            continue;
+        }
+
         if (!strcmp(argv[i], "-o")) {
             if (!argv[i++])
                 usage(1);
@@ -28,11 +61,30 @@ static void parse_args(int argc, char **argv) {
             continue;
         }
 
+        if (!strcmp(argv[i], "-I")) {
+            if (!argv[++i])
+                usage(1);
+            add_include_path(argv[i]);
+            continue;
+        }
+
+        if (!strncmp(argv[i], "-I", 2)) {
+            add_include_path(argv[i] + 2);
+            continue;
+        }
+
         if (argv[i][0] == '-' && argv[i][1] != '\0')
             error("unknown argument: %s", argv[i]);
 
         input_path = argv[i];
     }
+
+    // 読み込んだ構文木には、作ったときのソースファイルの名前が入っている
+    if (opt_load_ast) {
+        if (input_path || opt_emit_ast)
+            usage(1);
+        return;
+    }
     if (!input_path)
         error("no input files");
 }
@@ -47,30 +99,44 @@ static FILE *open_file(char *path) {
     return out;
 }
 
-char *user_input; 
-
 int main(int ac, char **av) {
     parse_args(ac, av);
-    
-    // 入力長制限（DoS攻撃防止）
-    size_t input_len = strlen(av[1]);
-    if (input_len > 10000) {
-        fprintf(stderr, "エラー: プログラムが長すぎます（最大10000文字）\n");
-        return 1;
+    init_scan();
+
+    if (opt_load_ast) {
+        // 前のビルドで書き出した構文木を使う。
+        Obj *prog = load_ast(opt_load_ast);
+
+        // ASTをトラバース（走査）し、アセンブリを出力します。
+        codegen(prog, open_file(opt_o));
+    } else {
+        if (*input_path == '\0') {
+            fprintf(stderr, "エラー: 空のプログラムです\n");
+            return 1;
+        }
+
+        // トークン化して解析する。
+        tokenize_file(input_path);
+        if (opt_emit_ast) {
+            // 書き出す構文木には関数の本体も要るので、全体を解析してから生成する
+            Obj *prog = parse(false);
+            emit_ast(prog, opt_emit_ast);
+            codegen(prog, open_file(opt_o));
+        } else {
+            // 関数は解析し終えたものから生成し、その構文木を解放する
+            codegen_begin(open_file(opt_o));
+            Obj *prog = parse(true);
+            codegen_end(prog);
+        }
     }
-    
-    if (input_len == 0) {
-        fprintf(stderr, "エラー: 空のプログラムです\n");
-        return 1;
+
+    if (opt_stats) {
+        fprintf(stderr, "peak tokens: %d (%zu bytes)\n",
+                peak_tokens, peak_tokens * sizeof(Token));
+        fprintf(stderr, "headers: %d read, %d cached, %d skipped\n",
+                nheaders_read, nheaders_cached, nheaders_skipped);
+        print_arena_stats(stderr);
     }
-    
-    // トークン化して解析する。
-    user_input = av[1];
-    Token *tok = tokenize_file(input_path);
-    Obj *prog = parse(tok);
-
-    // ASTをトラバース（走査）し、アセンブリを出力します。
-    FILE *out = open_file(opt_o);
-    codegen(prog, out);
+    arena_release();
     return 0;
 }
\ No newline at end of file
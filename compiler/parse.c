@@ -1,93 +1,383 @@
 #include "compiler.h"
-
-// ローカル変数またはグローバル変数のスコープ
-typedef struct VarScope VarScope;
-struct VarScope {
-    VarScope *next;
+#include <pthread.h>
+
+// 変数のスコープ。
+//
+// 関数の中で見えている変数は、名前のアトムをキーとする 1 つのハッシュ表に
+// まとめて置く。内側のブロックで同じ名前を宣言すると表の値を置き換え、
+// 置き換える前の値を取り消しログに積む。ブロックを出るときは、そのブロックで
+// 積んだ分だけログを巻き戻す。
+//
+// 関数の本体は複数のスレッドで解析することがあるので、この表と作業用の
+// スタックはスレッドごとに持つ。大域変数は別の表 (global_table) に置く。
+
+// 名前と、その名前で今見えている変数。var が NULL なら見えていない
+typedef struct {
     char *name;
     Obj *var;
-};
+} VarEntry;
 
-// ブロックスコープ
-typedef struct Scope Scope;
-struct Scope {
-    Scope *next;
-    VarScope *vars;
-};
+// 宣言で隠した変数
+typedef struct {
+    char *name;
+    Obj *prev;
+} VarUndo;
+
+// オープンアドレス法のハッシュ表。容量は常に 2 のべき乗。
+static _Thread_local VarEntry *var_table;
+static _Thread_local int var_table_len;
+static _Thread_local int var_table_cap;
+
+static _Thread_local VarUndo *undo_log;
+static _Thread_local int undo_len;
+static _Thread_local int undo_cap;
+
+// 各ブロックに入ったときの undo_len
+static _Thread_local int *scope_marks;
+static _Thread_local int scope_depth;
+static _Thread_local int scope_marks_cap;
 
 // 解析中に作成されたすべてのローカル変数のインスタンスは、
 // このリストに蓄積されます。
-static Obj *locals;
+static _Thread_local Obj *locals;
+
+// 関数の本体で作った文字列リテラル。新しいものが先頭
+static _Thread_local Obj *literals;
+
+// 本体を解析している関数と、その中で作った文字列リテラルの数
+static _Thread_local Obj *current_fn;
+static _Thread_local int nliterals;
+
+// 宣言子を読んだ結果。型は正準化して共有するので、宣言する名前は
+// 型とは別に持つ。トークンは宣言を解析している間だけ有効
+typedef struct {
+    Type *ty;
+    Token *name;
+    char **param_names; // 関数の宣言子なら仮引数の名前のアトム。ty->params と同じ順
+} Decl;
+
+// 仮引数の宣言子を読み終えるまで積んでおくスタック。
+// 仮引数の中の関数の宣言子はその上に積む。
+static _Thread_local Decl *param_stack;
+static _Thread_local int param_stack_len;
+static _Thread_local int param_stack_cap;
+
+// 大域変数と関数。新しいものが先頭。主スレッドだけが使う
 static Obj *globals;
 
-static Scope *scope = &(Scope){};
+// 大域変数の表。主スレッドがトップレベルの宣言を読みながら書き込み、
+// 関数の本体を解析するスレッドが読む。本体からはその関数より前に宣言した
+// 大域変数だけが見えるので、宣言の順番を一緒に覚えておく。
+typedef struct GlobalEntry GlobalEntry;
+struct GlobalEntry {
+    char *name;
+    Obj *var;
+    int seq;            // 何番目に宣言した大域変数か
+    GlobalEntry *older; // 同じ名前の前の宣言
+};
+
+// オープンアドレス法のハッシュ表。容量は常に 2 のべき乗。
+// 本体を並列に解析している間はロックを取って読み書きする。
+static GlobalEntry *global_table;
+static int global_table_len;
+static int global_table_cap;
+static int nglobals;
+static pthread_rwlock_t global_lock = PTHREAD_RWLOCK_INITIALIZER;
+static bool parallel;
 
-// 再帰深度制限（スタックオーバーフロー防止）
-static int recursion_depth = 0;
-#define MAX_RECURSION_DEPTH 1000
+// 解析している本体から見える大域変数の数
+static _Thread_local int visible_globals;
 
 static Type *declspec(Token **rest, Token *tok);
-static Type *declarator(Token **rest, Token *tok, Type *ty);
+static Decl declarator(Token **rest, Token *tok, Type *ty);
 static Node *declaration(Token **rest, Token *tok);
 static Node *compound_stmt(Token **rest, Token *tok);
 static Node *stmt(Token **rest, Token *tok);
 static Node *expr(Token **rest, Token *tok);
 static Node *expr_stmt(Token **rest, Token *tok);
-static Node *assign(Token **rest, Token *tok);
-static Node *equality(Token **rest, Token *tok);
-static Node *relational(Token **rest, Token *tok);
-static Node *add(Token **rest, Token *tok);
-static Node *mul(Token **rest, Token *tok);
-static Node *postfix(Token **rest, Token *tok);
-static Node *unary(Token **rest, Token *tok);
 static Node *primary(Token **rest, Token *tok);
 
+// name の入る場所を返します。名前はアトムなので、ポインタを比べるだけでよい。
+static VarEntry *var_slot(char *name) {
+    uint64_t hash = (uintptr_t)name * 0x9e3779b97f4a7c15;
+    for (int i = (hash >> 32) & (var_table_cap - 1);; i = (i + 1) & (var_table_cap - 1))
+        if (!var_table[i].name || var_table[i].name == name)
+            return &var_table[i];
+}
+
+static void grow_var_table(void) {
+    VarEntry *old = var_table;
+    int old_cap = var_table_cap;
+    var_table_cap = var_table_cap ? var_table_cap * 2 : 256;
+    var_table = calloc(var_table_cap, sizeof(VarEntry));
+    if (!var_table)
+        error("メモリ不足です");
+    for (int i = 0; i < old_cap; i++)
+        if (old[i].name)
+            *var_slot(old[i].name) = old[i];
+    free(old);
+}
+
 static void enter_scope(void) {
-    Scope *sc = calloc(1, sizeof(Scope));
-    sc->next = scope;
-    scope = sc;
+    if (scope_depth == scope_marks_cap) {
+        scope_marks_cap = scope_marks_cap ? scope_marks_cap * 2 : 64;
+        scope_marks = realloc(scope_marks, sizeof(int) * scope_marks_cap);
+        if (!scope_marks)
+            error("メモリ不足です");
+    }
+    scope_marks[scope_depth++] = undo_len;
 }
 
+// ブロックの中で宣言した変数を、隠していた変数に戻します。
 static void leave_scope(void) {
-    scope = scope->next;
+    int mark = scope_marks[--scope_depth];
+    while (undo_len > mark) {
+        VarUndo *u = &undo_log[--undo_len];
+        var_slot(u->name)->var = u->prev;
+    }
+}
+
+static GlobalEntry *global_slot(char *name) {
+    uint64_t hash = (uintptr_t)name * 0x9e3779b97f4a7c15;
+    for (int i = (hash >> 32) & (global_table_cap - 1);; i = (i + 1) & (global_table_cap - 1))
+        if (!global_table[i].name || global_table[i].name == name)
+            return &global_table[i];
+}
+
+static void grow_global_table(void) {
+    GlobalEntry *old = global_table;
+    int old_cap = global_table_cap;
+    global_table_cap = global_table_cap ? global_table_cap * 2 : 256;
+    global_table = calloc(global_table_cap, sizeof(GlobalEntry));
+    if (!global_table)
+        error("メモリ不足です");
+    for (int i = 0; i < old_cap; i++)
+        if (old[i].name)
+            *global_slot(old[i].name) = old[i];
+    free(old);
+}
+
+static void add_global(char *name, Obj *var) {
+    if (parallel)
+        pthread_rwlock_wrlock(&global_lock);
+    if ((global_table_len + 1) * 2 > global_table_cap)
+        grow_global_table();
+
+    GlobalEntry *e = global_slot(name);
+    if (e->name) {
+        GlobalEntry *older = arena_alloc(ARENA_OBJ, sizeof(GlobalEntry));
+        *older = *e;
+        e->older = older;
+    } else {
+        e->name = name;
+        e->older = NULL;
+        global_table_len++;
+    }
+    e->var = var;
+    e->seq = nglobals++;
+    if (parallel)
+        pthread_rwlock_unlock(&global_lock);
+}
+
+static Obj *find_global(char *name) {
+    if (parallel)
+        pthread_rwlock_rdlock(&global_lock);
+    Obj *var = NULL;
+    if (global_table_cap) {
+        GlobalEntry *e = global_slot(name);
+        if (e->name) {
+            while (e && e->seq >= visible_globals)
+                e = e->older;
+            if (e)
+                var = e->var;
+        }
+    }
+    if (parallel)
+        pthread_rwlock_unlock(&global_lock);
+    return var;
 }
 
-// 名前からローカル変数を検索します。
+// 名前から変数を検索します。
 static Obj *find_var(Token *tok) {
-    for (Scope *sc = scope; sc; sc = sc->next)
-        for (VarScope *sc2 = sc->vars; sc2; sc2 = sc2->next)
-            if (equal(tok, sc2->name))
-                return sc2->var;
-    return NULL;
+    if (var_table_cap) {
+        Obj *var = var_slot(tok->name)->var;
+        if (var)
+            return var;
+    }
+    return find_global(tok->name);
+}
+
+// kind のノードが使うメンバまでの大きさ
+size_t node_size(NodeKind kind) {
+    switch (kind) {
+    case ND_NUM:
+        return offsetof(Node, lhs);
+    case ND_VAR:
+        return offsetof(Node, var) + sizeof(Obj *);
+    case ND_NEG:
+    case ND_ADDR:
+    case ND_DEREF:
+    case ND_RETURN:
+    case ND_EXPR_STMT:
+        return offsetof(Node, rhs);
+    case ND_IF:
+        return offsetof(Node, inc);
+    case ND_BLOCK:
+    case ND_STMT_EXPR:
+        return offsetof(Node, nbody) + sizeof(int);
+    default:
+        return sizeof(Node);
+    }
 }
 
 // 左辺と右辺を受け取る2項演算子
 static Node *new_node(NodeKind kind, Token *tok) {
-    Node *node = calloc(1, sizeof(Node));
+    Node *node = arena_alloc(ARENA_NODE, node_size(kind));
     node->kind = kind;
-    node->tok = tok;
+    node->loc = tok->loc;
     return node;
 }
 
+// 文や引数の列を組み立てる作業用のスタック。
+// 入れ子になった列はその上に積み、組み終えた列はアリーナの配列に移して取り除く。
+static _Thread_local Node **node_stack;
+static _Thread_local int node_stack_len;
+static _Thread_local int node_stack_cap;
+
+static void push_node(Node *node) {
+    if (node_stack_len == node_stack_cap) {
+        node_stack_cap = node_stack_cap ? node_stack_cap * 2 : 256;
+        node_stack = realloc(node_stack, sizeof(Node *) * node_stack_cap);
+        if (!node_stack)
+            error("メモリ不足です");
+    }
+    node_stack[node_stack_len++] = node;
+}
+
+// base より上に積んだノードをアリーナの配列に移し、その数を *len に入れます。
+static Node **pop_nodes(int base, int *len) {
+    *len = node_stack_len - base;
+    Node **nodes = arena_alloc(ARENA_NODE, sizeof(Node *) * *len);
+    memcpy(nodes, node_stack + base, sizeof(Node *) * *len);
+    node_stack_len = base;
+    return nodes;
+}
+
+// 数値を受け取るノード
+static Node *new_num(int val, Token *tok) {
+    Node *node = new_node(ND_NUM, tok);
+    node->val = val;
+    node->ty = ty_int;
+    return node;
+}
+
+static bool is_num(Node *node, int val) {
+    return node->kind == ND_NUM && node->val == val;
+}
+
+// 評価を省いても結果の変わらない式なら true を返します。
+static bool is_pure(Node *node) {
+    return node->kind == ND_NUM || node->kind == ND_VAR;
+}
+
+// 演算は 64 ビットで行うが、数値ノードは int の値しか持てない
+static bool fits_int(int64_t val) {
+    return INT_MIN <= val && val <= INT_MAX;
+}
+
+// 定数同士の演算を計算し、結果の変わらない演算を取り除きます。
+// 代わりに使うノードを返す。畳み込めなければ NULL を返す。
+// 取り除くのは、残るノードの型が演算の結果の型と同じ場合だけ。
+static Node *fold_binary(NodeKind kind, Node *lhs, Node *rhs, Token *tok) {
+    if (lhs->kind == ND_NUM && rhs->kind == ND_NUM) {
+        int64_t a = lhs->val;
+        int64_t b = rhs->val;
+        int64_t val;
+
+        switch (kind) {
+        case ND_ADD: val = a + b; break;
+        case ND_SUB: val = a - b; break;
+        case ND_MUL: val = a * b; break;
+        case ND_DIV:
+            // 0 による除算は実行時に任せる
+            if (b == 0)
+                return NULL;
+            val = a / b;
+            break;
+        case ND_EQ: val = a == b; break;
+        case ND_NE: val = a != b; break;
+        case ND_LT: val = a < b; break;
+        case ND_LE: val = a <= b; break;
+        default:
+            return NULL;
+        }
+        return fits_int(val) ? new_num(val, tok) : NULL;
+    }
+
+    // 算術演算の結果の型
+    Type *ty = lhs->ty;
+
+    switch (kind) {
+    case ND_ADD:
+        if (is_num(rhs, 0))
+            return lhs;
+        if (is_num(lhs, 0) && rhs->ty == ty)
+            return rhs;
+
+        // (x + a) + b を x + (a + b) にする。定数の添字をまとめる
+        if (rhs->kind == ND_NUM && lhs->kind == ND_ADD && lhs->rhs->kind == ND_NUM &&
+            fits_int((int64_t)lhs->rhs->val + rhs->val)) {
+            lhs->rhs->val += rhs->val;
+            return lhs;
+        }
+        return NULL;
+    case ND_SUB:
+        if (is_num(rhs, 0))
+            return lhs;
+        return NULL;
+    case ND_MUL:
+        if (is_num(rhs, 1))
+            return lhs;
+        if (is_num(lhs, 1) && rhs->ty == ty)
+            return rhs;
+        if (is_num(rhs, 0) && is_pure(lhs) && ty == ty_int)
+            return rhs;
+        if (is_num(lhs, 0) && is_pure(rhs))
+            return lhs;
+        return NULL;
+    case ND_DIV:
+        if (is_num(rhs, 1))
+            return lhs;
+        return NULL;
+    default:
+        return NULL;
+    }
+}
+
 // 2項演算子ノード
 static Node *new_binary(NodeKind kind, Node *lhs, Node *rhs, Token *tok) {
-    Node *node = new_node(kind, tok);
+    Node *node = fold_binary(kind, lhs, rhs, tok);
+    if (node)
+        return node;
+
+    node = new_node(kind, tok);
     node->lhs = lhs;
     node->rhs = rhs;
+    add_type(node);
     return node;
 }
 
 // 単項演算子ノード
 static Node *new_unary(NodeKind kind, Node *expr, Token *tok) {
+    // 数値の符号反転は畳み込む
+    if (kind == ND_NEG && expr->kind == ND_NUM && expr->val != INT_MIN) {
+        expr->val = -expr->val;
+        return expr;
+    }
+
     Node *node = new_node(kind, tok);
     node->lhs = expr;
-    return node;
-}
-
-// 数値を受け取るノード
-static Node *new_num(int val, Token *tok) {
-    Node *node = new_node(ND_NUM, tok);
-    node->val = val;
+    add_type(node);
     return node;
 }
 
@@ -95,40 +385,37 @@ static Node *new_num(int val, Token *tok) {
 static Node *new_var_node(Obj *var, Token *tok) {
     Node *node = new_node(ND_VAR, tok);
     node->var = var;
+    node->ty = var->ty;
     return node;
 }
 
-static VarScope *push_scope(char *name, Obj *var) {
-    VarScope *sc = calloc(1, sizeof(VarScope));
-    sc->name = name;
-    sc->var = var;
-    sc->next = scope->vars;
-    scope->vars = sc;
-    return sc;
+static void push_scope(char *name, Obj *var) {
+    if ((var_table_len + 1) * 2 > var_table_cap)
+        grow_var_table();
+
+    VarEntry *e = var_slot(name);
+    if (!e->name) {
+        e->name = name;
+        var_table_len++;
+    }
+
+    if (undo_len == undo_cap) {
+        undo_cap = undo_cap ? undo_cap * 2 : 256;
+        undo_log = realloc(undo_log, sizeof(VarUndo) * undo_cap);
+        if (!undo_log)
+            error("メモリ不足です");
+    }
+    undo_log[undo_len++] = (VarUndo){name, e->var};
+    e->var = var;
 }
 
 // 新しいローカル変数作成
 static Obj *new_var(char *name, Type *ty) {
-    Obj *var = calloc(1, sizeof(Obj));
-    if (!var) {
-        error("メモリ不足です");
-    }
-    
-    // 変数名の長さ制限（バッファオーバーフロー防止）
-    size_t name_len = strlen(name);
-    if (name_len > 255) {
-        error("変数名が長すぎます");
-    }
-    
-    var->name = malloc(name_len + 1);
-    if (!var->name) {
-        free(var);
-        error("メモリ不足です");
-    }
-    strcpy(var->name, name);
-    
+    Obj *var = arena_alloc(ARENA_OBJ, sizeof(Obj));
+
+    // 名前はアトムか new_unique_name() が作った文字列なので複製しない
+    var->name = name;
     var->ty = ty;
-    push_scope(name, var);
     return var;
 }
 
@@ -137,6 +424,7 @@ static Obj *new_lvar(char *name, Type *ty) {
     var->is_local = true;
     var->next = locals;
     locals = var;
+    push_scope(name, var);
     return var;
 }
 
@@ -144,28 +432,31 @@ static Obj *new_gvar(char *name, Type *ty) {
     Obj *var = new_var(name, ty);
     var->next = globals;
     globals = var;
+    add_global(name, var);
     return var;
 }
 
+// 関数の中で一意な名前を返します。関数名も付けるので、どのスレッドが
+// どの順で本体を解析しても同じ名前になる。
 static char *new_unique_name(void) {
-    static int id = 0;
-    return format(".L..%d", id++);
-}
-
-static Obj *new_anon_gvar(Type *ty) {
-    return new_gvar(new_unique_name(), ty);
+    return arena_format(".L..%s.%d", current_fn->name, nliterals++);
 }
 
+// 本体を生成し終えても .data に出すので、翻訳単位のアリーナに置く
 static Obj *new_string_literal(char *p, Type *ty) {
-    Obj *var = new_anon_gvar(ty);
+    Arena *arena = arena_use(NULL);
+    Obj *var = new_var(new_unique_name(), ty);
+    arena_use(arena);
     var->init_data = p;
+    var->next = literals;
+    literals = var;
     return var;
 }
 
 static char *get_ident(Token *tok) {
     if (tok->kind != TK_IDENT)
         error_tok(tok, "expected an identifier");
-    return strndup(tok->loc, tok->len);
+    return tok->name;
 }
 
 static int get_number(Token *tok) {
@@ -176,46 +467,61 @@ static int get_number(Token *tok) {
 
 // 宣言指定子 = "char" | "int"
 static Type *declspec(Token **rest, Token *tok) {
-    if (equal(tok, "char")) {
-        *rest = tok->next;
+    if (tok->id == KW_CHAR) {
+        *rest = tok + 1;
         return ty_char;
     }
 
-    *rest = skip(tok, "int");
+    *rest = skip(tok, KW_INT);
     return ty_int;
 }
 
+static void push_param(Decl param) {
+    if (param_stack_len == param_stack_cap) {
+        param_stack_cap = param_stack_cap ? param_stack_cap * 2 : 64;
+        param_stack = realloc(param_stack, sizeof(Decl) * param_stack_cap);
+        if (!param_stack)
+            error("メモリ不足です");
+    }
+    param_stack[param_stack_len++] = param;
+}
+
 // func-params = (param ("," param)*)? ")"
 // param       = declspec declarator
-static Type *func_params(Token **rest, Token *tok, Type *ty) {
-    Type head = {};
-    Type *cur = &head;
+static Type *func_params(Token **rest, Token *tok, Type *ty, char ***param_names) {
+    int base = param_stack_len;
 
-    while (!equal(tok, ")")) {
-        if (cur != &head)
-            tok = skip(tok, ",");
+    while (tok->id != P_RPAREN) {
+        if (param_stack_len != base)
+            tok = skip(tok, P_COMMA);
         Type *basety = declspec(&tok, tok);
-        Type *ty = declarator(&tok, tok, basety);
-        cur = cur->next = copy_type(ty);
+        push_param(declarator(&tok, tok, basety));
     }
 
-    ty = func_type(ty);
-    ty->params = head.next;
-    *rest = tok->next;
-    return ty;
+    int nparams = param_stack_len - base;
+    Type *params[nparams + 1];
+    *param_names = arena_alloc(ARENA_OBJ, sizeof(char *) * nparams);
+    for (int i = 0; i < nparams; i++) {
+        params[i] = param_stack[base + i].ty;
+        (*param_names)[i] = get_ident(param_stack[base + i].name);
+    }
+    param_stack_len = base;
+
+    *rest = tok + 1;
+    return func_type(ty, params, nparams);
 }
 
 // type-suffix = "(" func-params
 //             | "[" num "]"  type-suffix
 //             | ε
-static Type *type_suffix(Token **rest, Token *tok, Type *ty) {
-    if (equal(tok, "(")) 
-        return func_params(rest, tok->next, ty);
-
-    if (equal(tok, "[")) {
-        int sz = get_number(tok->next);
-        tok = skip(tok->next->next, "]");
-        ty = type_suffix(rest, tok, ty);
+static Type *type_suffix(Token **rest, Token *tok, Type *ty, char ***param_names) {
+    if (tok->id == P_LPAREN) 
+        return func_params(rest, tok + 1, ty, param_names);
+
+    if (tok->id == P_LBRACKET) {
+        int sz = get_number(tok + 1);
+        tok = skip(tok + 2, P_RBRACKET);
+        ty = type_suffix(rest, tok, ty, param_names);
         return array_of(ty, sz);
     }
 
@@ -224,52 +530,50 @@ static Type *type_suffix(Token **rest, Token *tok, Type *ty) {
 }
 
 // 宣言指定子 = "*"* ident(識別子)
-static Type *declarator(Token **rest, Token *tok, Type *ty) {
-    while (consume(&tok, tok, "*"))
+static Decl declarator(Token **rest, Token *tok, Type *ty) {
+    while (consume(&tok, tok, P_STAR))
         ty = pointer_to(ty);
 
     if (tok->kind != TK_IDENT)
         error_tok(tok, "expected a variable name");
 
-    ty = type_suffix(rest, tok->next, ty);
-    ty->name = tok;
-    return ty;
+    Decl decl = {.name = tok};
+    decl.ty = type_suffix(rest, tok + 1, ty, &decl.param_names);
+    return decl;
 }
 
 // 宣言 = declspec (declarator ("=" expr)? ("," declarator ("=" expr)?)*)? ";"
 static Node *declaration(Token **rest, Token *tok) {
     Type *basety = declspec(&tok, tok);
 
-    Node head = {};
-    Node *cur = &head;
-
+    int base = node_stack_len;
     int i = 0;
 
-    while (!equal(tok, ";")) {
+    while (tok->id != P_SEMICOLON) {
         if (i++ > 0)
-            tok = skip(tok, ",");
+            tok = skip(tok, P_COMMA);
 
-        Type *ty = declarator(&tok, tok, basety);
-        Obj *var = new_lvar(get_ident(ty->name), ty);
+        Decl decl = declarator(&tok, tok, basety);
+        Obj *var = new_lvar(get_ident(decl.name), decl.ty);
 
-        if (!equal(tok, "="))
+        if (tok->id != P_ASSIGN)
             continue;
 
-        Node *lhs = new_var_node(var, ty->name);
-        Node *rhs = assign(&tok, tok->next);
+        Node *lhs = new_var_node(var, decl.name);
+        Node *rhs = expr(&tok, tok + 1);
         Node *node = new_binary(ND_ASSIGN, lhs, rhs, tok);
-        cur = cur->next = new_unary(ND_EXPR_STMT, node, tok);
+        push_node(new_unary(ND_EXPR_STMT, node, tok));
     }
 
     Node *node = new_node(ND_BLOCK, tok);
-    node->body = head.next;
-    *rest = tok->next;
+    node->body = pop_nodes(base, &node->nbody);
+    *rest = tok + 1;
     return node;
 }
 
 // 指定されたトークンが型を表す場合に true を返します。
 static bool is_typename(Token *tok) {
-    return equal(tok, "char") || equal(tok, "int");
+    return tok->id == KW_CHAR || tok->id == KW_INT;
 }
 
 // stmt = "return" expr ";"
@@ -279,164 +583,108 @@ static bool is_typename(Token *tok) {
 //      | "{" compound-stmt
 //      | expr-stmt
 static Node *stmt(Token **rest, Token *tok) {
-    if (equal(tok, "return")) {
-        Node *node = new_unary(ND_RETURN, expr(&tok, tok->next), tok);
-        *rest = skip(tok, ";");
+    switch (tok->id) {
+    case KW_RETURN: {
+        Node *node = new_unary(ND_RETURN, expr(&tok, tok + 1), tok);
+        *rest = skip(tok, P_SEMICOLON);
         return node;
     }
 
-    if (equal(tok, "while")) {
+    case KW_WHILE: {
         Node *node = new_node(ND_FOR, tok);
-        tok = skip(tok->next, "(");
+        tok = skip(tok + 1, P_LPAREN);
         node->cond = expr(&tok, tok);
-        tok = skip(tok, ")");
+        tok = skip(tok, P_RPAREN);
         node->then = stmt(rest, tok);
         return node;
     }
 
-    if (equal(tok, "if")) {
-        Node *node = new_node(ND_IF, tok);
-        tok = skip(tok->next, "(");
-        node->cond = expr(&tok, tok);
-        tok = skip(tok, ")");
-        node->then = stmt(&tok, tok);
-        if (equal(tok, "else"))
-            node->els = stmt(&tok, tok->next);
+    case KW_IF: {
+        // "else if" の連鎖は何段続いても再帰せずに読む
+        Node *head = NULL;
+        Node **link = &head;
+        for (;;) {
+            Node *node = new_node(ND_IF, tok);
+            tok = skip(tok + 1, P_LPAREN);
+            node->cond = expr(&tok, tok);
+            tok = skip(tok, P_RPAREN);
+            node->then = stmt(&tok, tok);
+            *link = node;
+
+            if (tok->id != KW_ELSE)
+                break;
+            if (tok[1].id != KW_IF) {
+                node->els = stmt(&tok, tok + 1);
+                break;
+            }
+            tok++;
+            link = &node->els;
+        }
         *rest = tok;
-        return node;
+        return head;
     }
 
-    if (equal(tok, "for")) {
+    case KW_FOR: {
         Node *node = new_node(ND_FOR, tok);
-        tok = skip(tok->next, "(");
+        tok = skip(tok + 1, P_LPAREN);
 
         node->init = expr_stmt(&tok, tok);
 
-        if (!equal(tok, ";"))
+        if (tok->id != P_SEMICOLON)
             node->cond = expr(&tok, tok);
-        tok = skip(tok, ";");
+        tok = skip(tok, P_SEMICOLON);
 
-        if (!equal(tok, ")"))
+        if (tok->id != P_RPAREN)
             node->inc = expr(&tok, tok);
-        tok = skip(tok, ")");
+        tok = skip(tok, P_RPAREN);
 
         node->then = stmt(rest, tok);
         return node;
     }
 
-    if (equal(tok, "{"))
-        return compound_stmt(rest, tok->next);
-    return expr_stmt(rest, tok);
+    case P_LBRACE:
+        return compound_stmt(rest, tok + 1);
+
+    default:
+        return expr_stmt(rest, tok);
+    }
 }
 
 // compound-stmt = (declaration | stmt)* "}"
 static Node *compound_stmt(Token **rest, Token *tok) {
     Node *node = new_node(ND_BLOCK, tok);
-    Node head = {};
-    Node *cur = &head;
+    int base = node_stack_len;
     enter_scope();
-    while (!equal(tok, "}")) {
+    while (tok->id != P_RBRACE) {
         if (is_typename(tok))
-            cur = cur->next = declaration(&tok, tok);
+            push_node(declaration(&tok, tok));
         else
-            cur = cur->next = stmt(&tok, tok);
-        add_type(cur);
+            push_node(stmt(&tok, tok));
     }
 
     leave_scope();
 
-    node->body = head.next;
-    *rest = tok->next;
+    node->body = pop_nodes(base, &node->nbody);
+    *rest = tok + 1;
     return node;
 }
 
 // expr-stmt = expr? ";"
 static Node *expr_stmt(Token **rest, Token *tok) {
-    if (equal(tok, ";")) {
-        *rest = tok->next;
+    if (tok->id == P_SEMICOLON) {
+        *rest = tok + 1;
         return new_node(ND_BLOCK, tok);
     }
     Node *node = new_unary(ND_EXPR_STMT, expr(&tok, tok), tok);
-    if (!equal(tok, ";")) {
+    if (tok->id != P_SEMICOLON) {
         if (tok->kind == TK_EOF) {
             error_tok(tok, "文の最後に ';' が必要です。プログラム全体をシングルクォートで囲んでください");
         } else {
             error_tok(tok, "';' が必要です");
         }
     }
-    *rest = tok->next;
-    return node;
-}
-
-// パーサー
-// expr = assign
-static Node *expr(Token **rest, Token *tok) {
-    return assign(rest, tok);
-}
-
-// assign = equality ("=" assign)?
-static Node *assign(Token **rest, Token *tok) {
-    Node *node = equality(&tok, tok);
-
-    if (equal(tok, "=")) {
-        Token *start = tok;
-        Node *rhs = assign(&tok, tok->next);
-        *rest = tok;
-        return new_binary(ND_ASSIGN, node, rhs, start);
-    }
-    *rest = tok;
-    return node;
-}
-
-static Node *equality(Token **rest, Token *tok) {
-    Node *node = relational(&tok, tok);
-
-    for (;;) {
-        Token *start = tok;
-
-        if (equal(tok, "==")) {
-            node = new_binary(ND_EQ, node, relational(&tok, tok->next), start);
-            continue;
-        }
-        if (equal(tok, "!=")) {
-            node = new_binary(ND_NE, node, relational(&tok, tok->next), start);
-            continue;
-        }
-
-        *rest = tok;
-        return node;
-    }
-}
-
-static Node *relational(Token **rest, Token *tok) {
-    Node *node = add(&tok, tok);
-
-    for (;;) {
-        Token *start = tok;
-
-    if (equal(tok, "<")) {
-        node = new_binary(ND_LT, node, add(&tok, tok->next), start);
-        continue;
-    }
-
-    if (equal(tok, "<=")) {
-        node = new_binary(ND_LE, node, add(&tok, tok->next), start);
-        continue;
-    }
-
-    if (equal(tok, ">")) {
-        node = new_binary(ND_LT, add(&tok, tok->next), node, start);
-        continue;
-    }
-
-    if (equal(tok, ">=")) {
-        node = new_binary(ND_LE, add(&tok, tok->next), node, start);
-        continue;
-    }
-
-    *rest = tok;
+    *rest = tok + 1;
     return node;
-    }
 }
 
 // +演算子はポインタ演算を行うためにオーバーロードされている。
@@ -447,9 +695,6 @@ static Node *relational(Token **rest, Token *tok) {
 // この関数は、そのスケーリングを行います。
 
 static Node *new_add(Node *lhs, Node *rhs, Token *tok) {
-    add_type(lhs);
-    add_type(rhs);
-
     // num + num
     if (is_integer(lhs->ty) && is_integer(rhs->ty))
         return new_binary(ND_ADD, lhs, rhs, tok);
@@ -471,9 +716,6 @@ static Node *new_add(Node *lhs, Node *rhs, Token *tok) {
 
 // +と同様に、-はポインタ型に対してオーバーロードされる。
 static Node *new_sub(Node *lhs, Node *rhs, Token *tok) {
-    add_type(lhs);
-    add_type(rhs);
-
     // num - num
     if (is_integer(lhs->ty) && is_integer(rhs->ty))
         return new_binary(ND_SUB, lhs, rhs, tok);
@@ -481,10 +723,7 @@ static Node *new_sub(Node *lhs, Node *rhs, Token *tok) {
     //ptr - num
     if (lhs->ty->base && is_integer(rhs->ty)) {
         rhs = new_binary(ND_MUL, rhs, new_num(lhs->ty->base->size, tok), tok);
-        add_type(rhs);
-        Node *node = new_binary(ND_SUB, lhs, rhs, tok);
-        node->ty = lhs->ty;
-        return node;
+        return new_binary(ND_SUB, lhs, rhs, tok);
     }
 
     // ptr - ptr は、2つの要素間の要素数を返します。
@@ -497,167 +736,292 @@ static Node *new_sub(Node *lhs, Node *rhs, Token *tok) {
     return NULL;
 }
 
-static Node *add(Token **rest, Token *tok) {
-    Node *node = mul(&tok, tok);
-
-    for (;;) {
-        Token *start = tok;
-    if (equal(tok, "+")) {
-        node = new_add(node, mul(&tok, tok->next), start);
-        continue;
-    }
+// 式は演算子の優先順位表を引きながら、演算子スタックと被演算子のスタック
+// (node_stack) で組み立てる。括弧、前置の単項演算子と添字も演算子スタックに
+// 積むので、式がどれだけ深く入れ子になってもネイティブのスタックは深くならない。
+//
+// expr       = assign
+// assign     = equality ("=" assign)?
+// equality   = relational ("==" relational | "!=" relational)*
+// relational = add ("<" add | "<=" add | ">" add | ">=" add)*
+// add        = mul ("+" mul | "-" mul)*
+// mul        = unary ("*" unary | "/" unary)*
+// unary      = ("+" | "-" | "*" | "&" | "sizeof") unary
+//            | postfix
+// postfix    = ("(" expr ")" | primary) ("[" expr "]")*
+
+// 優先順位。大きいほど強く結びつく
+enum {
+    PREC_NONE,       // 2項演算子ではない
+    PREC_GROUP,      // "(" と "["。対応する閉じ括弧が来るまで取り除かない
+    PREC_ASSIGN,
+    PREC_EQUALITY,
+    PREC_RELATIONAL,
+    PREC_ADD,
+    PREC_MUL,
+    PREC_PREFIX,     // 前置の単項演算子
+};
 
-    if (equal(tok, "-")) {
-        node = new_sub(node, mul(&tok, tok->next), start);
-        continue;
-    }
+// 2項演算子の優先順位
+static const unsigned char binary_prec[] = {
+    [P_ASSIGN] = PREC_ASSIGN,
+    [P_EQ] = PREC_EQUALITY,
+    [P_NE] = PREC_EQUALITY,
+    [P_LT] = PREC_RELATIONAL,
+    [P_LE] = PREC_RELATIONAL,
+    [P_GT] = PREC_RELATIONAL,
+    [P_GE] = PREC_RELATIONAL,
+    [P_PLUS] = PREC_ADD,
+    [P_MINUS] = PREC_ADD,
+    [P_STAR] = PREC_MUL,
+    [P_SLASH] = PREC_MUL,
+};
 
-    *rest = tok;
-    return node;
+// 演算子スタックの要素
+typedef struct {
+    Token *tok;
+    int prec;
+} ExprOp;
+
+static _Thread_local ExprOp *op_stack;
+static _Thread_local int op_stack_len;
+static _Thread_local int op_stack_cap;
+
+static void push_op(Token *tok, int prec) {
+    if (op_stack_len == op_stack_cap) {
+        op_stack_cap = op_stack_cap ? op_stack_cap * 2 : 64;
+        op_stack = realloc(op_stack, sizeof(ExprOp) * op_stack_cap);
+        if (!op_stack)
+            error("メモリ不足です");
     }
+    op_stack[op_stack_len++] = (ExprOp){tok, prec};
 }
 
-static Node *mul(Token **rest, Token *tok) {
-    Node *node = unary(&tok, tok);
-
-    for (;;) {
-        Token *start = tok;
+static Node *pop_node(void) {
+    return node_stack[--node_stack_len];
+}
 
-    if (equal(tok, "*")) {
-        node = new_binary(ND_MUL, node, unary(&tok, tok->next), start);
-        continue;
+// 演算子スタックの一番上の演算子を被演算子に適用します。
+static void reduce(void) {
+    ExprOp op = op_stack[--op_stack_len];
+    Token *tok = op.tok;
+
+    if (op.prec == PREC_PREFIX) {
+        Node *node = pop_node();
+        switch (tok->id) {
+        case P_PLUS:
+            push_node(node);
+            return;
+        case P_MINUS:
+            push_node(new_unary(ND_NEG, node, tok));
+            return;
+        case P_AMP:
+            push_node(new_unary(ND_ADDR, node, tok));
+            return;
+        case P_STAR:
+            push_node(new_unary(ND_DEREF, node, tok));
+            return;
+        default: // sizeof
+            push_node(new_num(node->ty->size, tok));
+            return;
+        }
     }
 
-    if (equal(tok, "/")) {
-        node = new_binary(ND_DIV, node, unary(&tok, tok->next), start);
-        continue;
+    Node *rhs = pop_node();
+    Node *lhs = pop_node();
+    switch (tok->id) {
+    case P_ASSIGN:
+        push_node(new_binary(ND_ASSIGN, lhs, rhs, tok));
+        return;
+    case P_EQ:
+        push_node(new_binary(ND_EQ, lhs, rhs, tok));
+        return;
+    case P_NE:
+        push_node(new_binary(ND_NE, lhs, rhs, tok));
+        return;
+    case P_LT:
+        push_node(new_binary(ND_LT, lhs, rhs, tok));
+        return;
+    case P_LE:
+        push_node(new_binary(ND_LE, lhs, rhs, tok));
+        return;
+    case P_GT:
+        push_node(new_binary(ND_LT, rhs, lhs, tok));
+        return;
+    case P_GE:
+        push_node(new_binary(ND_LE, rhs, lhs, tok));
+        return;
+    case P_PLUS:
+        push_node(new_add(lhs, rhs, tok));
+        return;
+    case P_MINUS:
+        push_node(new_sub(lhs, rhs, tok));
+        return;
+    case P_STAR:
+        push_node(new_binary(ND_MUL, lhs, rhs, tok));
+        return;
+    default: // "/"
+        push_node(new_binary(ND_DIV, lhs, rhs, tok));
+        return;
     }
+}
 
-    *rest = tok;
-    return node;
+// op_base より上にある、prec より弱くない演算子をすべて適用します。
+// 右結合の演算子の前では同じ優先順位の演算子を残す。
+static void reduce_above(int op_base, int prec) {
+    while (op_stack_len > op_base) {
+        int top = op_stack[op_stack_len - 1].prec;
+        if (top < prec || (top == prec && prec == PREC_ASSIGN) || top == PREC_GROUP)
+            return;
+        reduce();
     }
 }
 
-// unary = ("+" | "-" | "*" | "&") unary
-//       | postfix
-static Node *unary(Token **rest, Token *tok) {
-    if (equal(tok, "+"))
-        return unary(rest, tok->next);
+// 閉じ括弧 tok に対応する開き括弧が op_base より上にあれば、
+// 括弧の中を適用し終えて開き括弧を返します。なければ NULL を返す。
+static Token *close_group(int op_base, Token *tok) {
+    reduce_above(op_base, PREC_GROUP);
+    if (op_stack_len == op_base)
+        return NULL;
+
+    Token *open = op_stack[--op_stack_len].tok;
+    if (open->id == P_LPAREN && tok->id != P_RPAREN)
+        skip(tok, P_RPAREN);
+    if (open->id == P_LBRACKET && tok->id != P_RBRACKET)
+        skip(tok, P_RBRACKET);
+    return open;
+}
 
-    if (equal(tok, "-"))
-        return new_unary(ND_NEG, unary(rest, tok->next), tok);
+static Node *expr(Token **rest, Token *tok) {
+    int node_base = node_stack_len;
+    int op_base = op_stack_len;
 
-    if (equal(tok, "&"))
-        return new_unary(ND_ADDR, unary(rest, tok->next), tok);
+    for (;;) {
+        // 被演算子。前置の単項演算子と "(" は積むだけにして先へ進む
+        for (;;) {
+            if (tok->id == P_PLUS || tok->id == P_MINUS || tok->id == P_STAR ||
+                tok->id == P_AMP || tok->id == KW_SIZEOF) {
+                push_op(tok++, PREC_PREFIX);
+                continue;
+            }
+            if (tok->id == P_LPAREN && tok[1].id != P_LBRACE) {
+                push_op(tok++, PREC_GROUP);
+                continue;
+            }
+            break;
+        }
+        push_node(primary(&tok, tok));
+
+        // 閉じ括弧と添字は、前置の単項演算子より先に直前の被演算子にかかる
+        bool index = false;
+        for (;;) {
+            if (tok->id == P_LBRACKET) {
+                push_op(tok++, PREC_GROUP);
+                index = true;
+                break;
+            }
 
-    if (equal(tok, "*"))
-        return new_unary(ND_DEREF, unary(rest, tok->next), tok);
+            if (tok->id != P_RPAREN && tok->id != P_RBRACKET)
+                break;
 
-    return postfix(rest, tok);
-}
+            // 対応する括弧がなければ、この式の外の閉じ括弧
+            Token *open = close_group(op_base, tok);
+            if (!open)
+                break;
+            tok++;
 
-// postfix = primary ("[" expr "]")*
-static Node *postfix(Token **rest, Token *tok) {
-    Node *node = primary(&tok, tok);
+            // x[y] は *(x+y) の省略形です
+            if (open->id == P_LBRACKET) {
+                Node *idx = pop_node();
+                Node *node = pop_node();
+                push_node(new_unary(ND_DEREF, new_add(node, idx, open), open));
+            }
+        }
 
-    while (equal(tok, "[")) {
-        // x[y] は *(x+y) の省略形です
-        Token *start = tok;
-        Node *idx = expr(&tok, tok->next);
-        tok = skip(tok, "]");
-        node = new_unary(ND_DEREF, new_add(node, idx, start), start);
+        // 添字の中の式を読む
+        if (index)
+            continue;
+
+        // 2項演算子
+        int prec = tok->id < sizeof(binary_prec) ? binary_prec[tok->id] : PREC_NONE;
+        if (prec == PREC_NONE)
+            break;
+        reduce_above(op_base, prec);
+        push_op(tok++, prec);
+    }
+
+    reduce_above(op_base, PREC_GROUP);
+    if (op_stack_len > op_base) {
+        Token *open = op_stack[op_stack_len - 1].tok;
+        skip(tok, open->id == P_LPAREN ? P_RPAREN : P_RBRACKET);
     }
+
+    assert(node_stack_len == node_base + 1);
     *rest = tok;
-    return node;
+    return pop_node();
 }
 
-// funcall = ident "(" (assign ("," assign)*)? ")"
+// funcall = ident "(" (expr ("," expr)*)? ")"
 static Node *funcall(Token **rest, Token *tok) {
     Token *start = tok;
-    tok = tok->next->next;
+    tok = tok + 2;
 
-    Node head = {};
-    Node *cur = &head;
+    int base = node_stack_len;
 
-    while (!equal(tok, ")")) {
-        if (cur != &head)
-            tok = skip(tok, ",");
-        cur = cur->next = assign(&tok, tok);
+    while (tok->id != P_RPAREN) {
+        if (node_stack_len != base)
+            tok = skip(tok, P_COMMA);
+        push_node(expr(&tok, tok));
     }
 
-    *rest = skip(tok, ")");
+    *rest = skip(tok, P_RPAREN);
 
     Node *node = new_node(ND_FUNCALL, start);
-    node->funcname = strndup(start->loc, start->len);
-    node->args = head.next;
+    node->funcname = start->name;
+    node->args = pop_nodes(base, &node->nargs);
+    add_type(node);
     return node;
 }
 
 // primary = "(" "{" stmt+ "}" ")"
-//         | "(" expr ")"
-//         | "sizeof" unary
 //         | ident func-args?
 //         | str
 //         | num
 static Node *primary(Token **rest, Token *tok) {
-    if (equal(tok, "(") && equal(tok->next, "{")) {
+    if (tok->id == P_LPAREN && tok[1].id == P_LBRACE) {
         // GNUステートメント式
         Node *node = new_node(ND_STMT_EXPR, tok);
-        node->body = compound_stmt(&tok, tok->next->next)->body;
-        *rest = skip(tok, ")");
-        return node;
-    }
-    // 次のトークンが "(" なら、"(" expr ")"
-    if (equal(tok, "(")) {
-        if (++recursion_depth > MAX_RECURSION_DEPTH) {
-            error("式が複雑すぎます");
-        }
-        
-        Node *node = expr(&tok, tok->next);
-        recursion_depth--;
-        *rest = skip(tok, ")");
-        return node;
-    }
-
-    if (equal(tok, "sizeof")) {
-        Node *node = unary(rest, tok->next);
+        Node *block = compound_stmt(&tok, tok + 2);
+        node->body = block->body;
+        node->nbody = block->nbody;
         add_type(node);
-        return new_num(node->ty->size, tok);
+        *rest = skip(tok, P_RPAREN);
+        return node;
     }
-
     if (tok->kind == TK_IDENT) {
         // Function call
-        if (equal(tok->next, "("))
+        if (tok[1].id == P_LPAREN)
             return funcall(rest, tok);
         
         // Variable
         Obj *var = find_var(tok);
-        if (!var) {
-            // 安全な文字列複製
-            if (tok->len <= 0 || tok->len > 255) {
-                error_tok(tok, "変数名の長さが不正です");
-            }
-            
-            char *name = malloc(tok->len + 1);
-            if (!name) {
-                error("メモリ不足です");
-            }
+        if (!var)
             error_tok(tok, "undefined variable");
-        }
-        *rest = tok->next;
+        *rest = tok + 1;
         return new_var_node(var, tok);
     }
 
     if (tok->kind == TK_STR) {
-        Obj *var = new_string_literal(tok->str, tok->ty);
-        *rest = tok->next;
+        StrLit *lit = get_str_lit(tok);
+        Obj *var = new_string_literal(lit->str, array_of(ty_char, lit->len));
+        *rest = tok + 1;
         return new_var_node(var, tok);
     }
 
     // それ以外は数値
     if (tok->kind == TK_NUM) {
         Node *node = new_num(tok->val, tok);
-        *rest = tok->next;
+        *rest = tok + 1;
         return node;
     }
 
@@ -665,72 +1029,412 @@ static Node *primary(Token **rest, Token *tok) {
     return NULL;
 }
 
-static void create_param_lvars(Type *param) {
-    if (param) {
-        create_param_lvars(param->next);
-        new_lvar(get_ident(param->name), param);
+// decl は読み終えた最初の宣言子
+static Token *global_variable(Token *tok, Type *basety, Decl decl) {
+    new_gvar(get_ident(decl.name), decl.ty);
+
+    while (!consume(&tok, tok, P_SEMICOLON)) {
+        tok = skip(tok, P_COMMA);
+        decl = declarator(&tok, tok, basety);
+        new_gvar(get_ident(decl.name), decl.ty);
     }
+    return tok;
 }
 
-// program = "{" compound-stmt
-static Token *function(Token *tok, Type *basety) {
-    Type *ty = declarator(&tok, tok, basety);
-
-    Obj *fn = new_gvar(get_ident(ty->name), ty);
-    fn->is_function = true;
+//
+// 関数の本体の解析
+//
+// 主スレッドはトップレベルの宣言を読み進め、関数の本体を FuncJob として積む。
+// 大きな入力ではワーカースレッドが積まれた本体を並列に解析し、小さな入力では
+// 主スレッドがその場で解析する。文字列リテラルの名前は関数ごとに付け、
+// globals の組み立ては最後にソースの順に行うので、どちらでも結果は同じになる。
+//
+// ワーカーがエラーを見つけた場合は、その本体の解析を打ち切ってエラーを残す。
+// 本体はソースの順に受け持つので、それより前の本体はどれも解析中か解析済みで
+// ある。それらを待ってから、ソースの順で最初のエラーを報告する。
+//
+// ストリーミングで解析する場合は、本体を解析したスレッドがそのままコードを
+// 生成する。本体のノードとローカル変数は本体ごとのアリーナに置き、生成し
+// 終えたら解放する。主スレッドは生成し終えたコードをソースの順に書き出す。
+// そのため、使うメモリは入力全体ではなく、同時に処理している本体の大きさで
+// 決まる。
+//
+
+// 並列に解析するのは、この数より多くの関数がある入力だけ
+#define PARALLEL_MIN_FUNCS 64
+
+// 1 スレッドあたり、主スレッドが先に積んでおく本体の数
+#define JOBS_AHEAD 16
+
+typedef struct {
+    Obj *fn;
+    char **param_names;
+    int visible_globals; // 本体から見える大域変数の数
+    TokenBuf body;       // "{" の次から宣言の終わりの TK_EOF まで
+    Obj *literals;       // 本体で作った文字列リテラル
+    Output *code;        // ストリーミングなら、生成したコード
+    char *error_loc;     // 解析または生成に失敗したときのエラー
+    char *error_msg;
+    bool failed;
+    bool done;
+} FuncJob;
+
+// 本体は片付けたものから解放し、文字列リテラルだけを job_literals に残す
+static FuncJob **jobs;
+static Obj **job_literals;
+static int njobs;
+static int jobs_cap;
+static int retired; // 片付けた本体の数
+
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+static int next_job;      // 次にワーカーが受け持つ本体
+static bool no_more_jobs; // 主スレッドがすべての本体を積み終えた
+static bool job_failed;   // いずれかの本体でエラーが見つかった
+static bool streaming;    // 解析し終えた本体からコードを生成する
+
+static pthread_t *workers;
+static int nworkers;
 
+// program = "{" compound-stmt
+static void function_body(FuncJob *job, Token *tok) {
+    Obj *fn = job->fn;
+    visible_globals = job->visible_globals;
+    current_fn = fn;
+    literals = NULL;
+    nliterals = 0;
+
+    // locals の先頭に足していくので、最後の仮引数から作る
     locals = NULL;
     enter_scope();
-    create_param_lvars(ty->params);
+    for (int i = fn->ty->nparams - 1; i >= 0; i--)
+        new_lvar(job->param_names[i], fn->ty->params[i]);
     fn->params = locals;
 
-    tok = skip(tok, "{");
     fn->body = compound_stmt(&tok, tok);
     fn->locals = locals;
     leave_scope();
-    return tok;
+    job->literals = literals;
+}
+
+// 本体の解析を打ち切った後、作業用の状態を空に戻します。
+static void reset_parser_state(void) {
+    if (var_table)
+        memset(var_table, 0, sizeof(VarEntry) * var_table_cap);
+    var_table_len = undo_len = scope_depth = 0;
+    node_stack_len = op_stack_len = param_stack_len = 0;
+}
+
+// 本体を解析し、ストリーミングならコードも生成します。tok が NULL なら
+// ワーカーとして job->body に保存したトークンを読み、コードはバッファに溜める。
+// 主スレッドがその場で解析するなら、コードは出力ファイルに直接書く。
+static void run_job(FuncJob *job, Token *tok) {
+    bool inline_job = tok;
+    Arena *arena = streaming ? arena_new() : NULL;
+    Arena *prev = arena_use(arena);
+
+    ErrorTrap trap;
+    error_trap = &trap;
+    if (setjmp(trap.jmp)) {
+        job->failed = true;
+        job->error_loc = trap.loc;
+        job->error_msg = trap.msg;
+        reset_parser_state();
+    } else {
+        if (!inline_job)
+            set_parse_buf(&job->body);
+        function_body(job, inline_job ? tok : job->body.toks);
+        if (streaming) {
+            Obj *fn = job->fn;
+            if (inline_job)
+                codegen_function(fn);
+            else
+                job->code = codegen_buffer(fn);
+            fn->body = NULL;
+            fn->params = fn->locals = NULL;
+        }
+    }
+    error_trap = NULL;
+    set_parse_buf(NULL);
+    arena_use(prev);
+    if (arena)
+        arena_free(arena);
+
+    free(job->body.toks);
+    free(job->body.strs);
+    job->body = (TokenBuf){0};
+}
+
+static void *parse_worker(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&job_lock);
+    for (;;) {
+        while (next_job == njobs && !no_more_jobs && !job_failed)
+            pthread_cond_wait(&job_cond, &job_lock);
+        if (next_job == njobs || job_failed)
+            break;
+
+        FuncJob *job = jobs[next_job++];
+        pthread_cond_broadcast(&job_cond);
+        pthread_mutex_unlock(&job_lock);
+        run_job(job, NULL);
+        pthread_mutex_lock(&job_lock);
+
+        job->done = true;
+        if (job->failed)
+            job_failed = true;
+        pthread_cond_broadcast(&job_cond);
+    }
+    pthread_mutex_unlock(&job_lock);
+
+    free(var_table);
+    free(undo_log);
+    free(scope_marks);
+    free(param_stack);
+    free(node_stack);
+    free(op_stack);
+    codegen_free_thread();
+    arena_flush_stats();
+    return NULL;
+}
+
+static void start_parse_workers(void) {
+    nworkers = thread_count();
+    workers = calloc(nworkers, sizeof(pthread_t));
+
+    // 入れ子になった文を再帰で解析するので、主スレッドと同じだけのスタックを使う
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, 8 * 1024 * 1024);
+
+    parallel = true;
+    next_job = njobs;
+    no_more_jobs = job_failed = false;
+    for (int i = 0; i < nworkers; i++)
+        if (pthread_create(&workers[i], &attr, parse_worker, NULL))
+            error("cannot create thread: %s", strerror(errno));
+    pthread_attr_destroy(&attr);
+}
+
+static void stop_parse_workers(void) {
+    pthread_mutex_lock(&job_lock);
+    no_more_jobs = true;
+    pthread_cond_broadcast(&job_cond);
+    pthread_mutex_unlock(&job_lock);
+
+    for (int i = 0; i < nworkers; i++)
+        pthread_join(workers[i], NULL);
+    free(workers);
+    workers = NULL;
+    nworkers = 0;
+    parallel = false;
+}
+
+// 終わった本体をソースの順に片付けます。生成したコードを書き出し、
+// 文字列リテラルを残して本体を解放する。失敗した本体はエラーを報告するまで残す。
+static void retire_jobs(void) {
+    for (;;) {
+        if (parallel)
+            pthread_mutex_lock(&job_lock);
+        FuncJob *job = retired < njobs ? jobs[retired] : NULL;
+        bool ready = job && job->done && !job->failed;
+        if (parallel)
+            pthread_mutex_unlock(&job_lock);
+        if (!ready)
+            return;
+
+        if (job->code)
+            codegen_write(job->code);
+        job_literals[retired] = job->literals;
+        free(job);
+
+        if (parallel)
+            pthread_mutex_lock(&job_lock);
+        jobs[retired++] = NULL;
+        if (parallel) {
+            pthread_cond_broadcast(&job_cond);
+            pthread_mutex_unlock(&job_lock);
+        }
+    }
+}
+
+static void push_job(FuncJob *job) {
+    if (njobs == jobs_cap) {
+        jobs_cap = jobs_cap ? jobs_cap * 2 : 256;
+        jobs = realloc(jobs, sizeof(FuncJob *) * jobs_cap);
+        job_literals = realloc(job_literals, sizeof(Obj *) * jobs_cap);
+        if (!jobs || !job_literals)
+            error("メモリ不足です");
+    }
+    jobs[njobs++] = job;
 }
 
-static Token *global_variable(Token *tok, Type *basety) {
-    bool first = true;
+// 本体を並列に解析しているなら、ワーカーに渡すために積みます。
+// そうでなければその場で解析する。
+static void add_job(FuncJob *job, Token *tok) {
+    if (!parallel) {
+        push_job(job);
+        run_job(job, tok);
+        if (job->failed)
+            error_at(job->error_loc, "%s", job->error_msg ? job->error_msg : "メモリ不足です");
+        job->done = true;
+        retire_jobs();
+        return;
+    }
 
-    while (!consume(&tok, tok, ";")) {
-        if (!first)
-            tok = skip(tok, ",");
-        first = false;
+    save_tokens(&job->body, tok);
 
-        Type *ty = declarator(&tok, tok, basety);
-        new_gvar(get_ident(ty->name), ty);
+    // 書き出していない本体が多すぎれば、先頭の本体が終わるのを待って書き出す
+    for (;;) {
+        retire_jobs();
+        pthread_mutex_lock(&job_lock);
+        bool wait = njobs - retired >= nworkers * JOBS_AHEAD && !job_failed;
+        if (wait && !jobs[retired]->done)
+            pthread_cond_wait(&job_cond, &job_lock);
+        pthread_mutex_unlock(&job_lock);
+        if (!wait)
+            break;
     }
+
+    pthread_mutex_lock(&job_lock);
+    push_job(job);
+    pthread_cond_broadcast(&job_cond);
+    pthread_mutex_unlock(&job_lock);
+}
+
+// decl は読み終えた関数の宣言子
+static Token *function(Token *tok, Decl decl) {
+    Obj *fn = new_gvar(get_ident(decl.name), decl.ty);
+    fn->is_function = true;
+
+    FuncJob *job = calloc(1, sizeof(FuncJob));
+    if (!job)
+        error("メモリ不足です");
+    job->fn = fn;
+    job->param_names = decl.param_names;
+    job->visible_globals = nglobals;
+
+    // 本体は宣言の終わりまで続く
+    tok = skip(tok, P_LBRACE);
+    add_job(job, tok);
+    while (tok->kind != TK_EOF)
+        tok++;
     return tok;
 }
 
-// 後方参照トークン。与えられたトークンが関数定義
-// または宣言の開始である場合にtrueを返します。
-static bool is_function(Token *tok) {
-    if (equal(tok, ";"))
-        return false;
+// トップレベルの宣言と本体の文字列リテラルをソースの順に並べて、
+// 1 スレッドで解析した場合と同じ globals を作ります。
+static Obj *merge_globals(void) {
+    // globals は新しいものが先頭なので、ソースの順に並べ直す
+    Obj *top = NULL;
+    while (globals) {
+        Obj *next = globals->next;
+        globals->next = top;
+        top = globals;
+        globals = next;
+    }
+
+    Obj *list = NULL;
+    Obj **job_lits = job_literals;
+    while (top) {
+        Obj *var = top;
+        top = top->next;
+        var->next = list;
+        list = var;
+        if (!var->is_function)
+            continue;
 
-    Type dummy = {};
-    Type *ty = declarator(&tok, tok, &dummy);
-    return ty->kind == TY_FUNC;
+        // 本体のリテラルも新しいものが先頭なので、作った順に並べ直す
+        Obj *lits = NULL;
+        for (Obj *lit = *job_lits++; lit;) {
+            Obj *next = lit->next;
+            lit->next = lits;
+            lits = lit;
+            lit = next;
+        }
+        while (lits) {
+            Obj *lit = lits;
+            lits = lits->next;
+            lit->next = list;
+            list = lit;
+        }
+    }
+    return list;
 }
 
 // program = (function-definition | global-variable)*
-Obj *parse(Token *tok) {
+//
+// トークンはトップレベルの宣言 1 つ分ずつ tokenize_next() から受け取る。
+// 1 つの宣言を読み終えたら、そのトークンはもう参照しない。
+//
+// stream が真なら、関数のコードを codegen_begin() で開いた出力に書きながら
+// 解析する。返す globals の関数には本体がないので、codegen_end() に渡して
+// 大域変数と文字列リテラルを書く。
+Obj *parse(bool stream) {
+    // 前の翻訳単位の変数はアリーナとともに解放されているので、表を空にする
     globals = NULL;
-    
-    while (tok->kind != TK_EOF) {
-        Type *basety = declspec(&tok, tok);
-        
-        // 関数
-        if (is_function(tok)) {
-            tok = function(tok, basety);
-            continue;
+    if (global_table)
+        memset(global_table, 0, sizeof(GlobalEntry) * global_table_cap);
+    global_table_len = nglobals = 0;
+    reset_parser_state();
+    reset_types();
+    njobs = retired = 0;
+    streaming = stream;
+
+    // 並列に解析している間は、主スレッドのエラーもすぐには報告しない
+    ErrorTrap trap;
+    bool failed = false;
+    bool can_parallelize = thread_count() > 1;
+
+    Token *tok;
+    while (!failed && (tok = tokenize_next())->kind != TK_EOF) {
+        if (can_parallelize && !parallel && njobs >= PARALLEL_MIN_FUNCS) {
+            start_parse_workers();
+            error_trap = &trap;
+            if (setjmp(trap.jmp)) {
+                failed = true;
+                break;
+            }
         }
 
-        // グローバル変数
-        tok = global_variable(tok, basety);
+        while (tok->kind != TK_EOF) {
+            Type *basety = declspec(&tok, tok);
+            if (consume(&tok, tok, P_SEMICOLON))
+                continue;
+
+            // 宣言子は一度だけ読み、その型で関数かグローバル変数かを決める
+            Decl decl = declarator(&tok, tok, basety);
+
+            // 関数
+            if (decl.ty->kind == TY_FUNC) {
+                tok = function(tok, decl);
+                continue;
+            }
+
+            // グローバル変数
+            tok = global_variable(tok, basety, decl);
+        }
+
+        if (parallel) {
+            pthread_mutex_lock(&job_lock);
+            failed = job_failed;
+            pthread_mutex_unlock(&job_lock);
+        }
+    }
+
+    if (parallel) {
+        error_trap = NULL;
+        stop_parse_workers();
+
+        // ソースの順で最初のエラーを報告する。本体のエラーがなければ主スレッドのエラー
+        retire_jobs();
+        if (retired < njobs && jobs[retired]->failed) {
+            trap.loc = jobs[retired]->error_loc;
+            trap.msg = jobs[retired]->error_msg;
+            failed = true;
+        }
+        if (failed)
+            error_at(trap.loc, "%s", trap.msg ? trap.msg : "メモリ不足です");
     }
-    return globals;
+    return merge_globals();
 }
@@ -0,0 +1,1049 @@
+// C プリプロセッサ。
+//
+// トークナイザが読んだトークン列に対して #include, #define, #undef と
+// 条件付きコンパイルを処理し、マクロを展開したトークンを 1 つずつ返す。
+// 外部のプリプロセッサを起動しなくても、ヘッダを含むファイルをそのまま扱える。
+//
+// マクロの展開は、置き換えたトークン列を文脈 (Context) として積んで読み進める。
+// 文脈を読み終えるまでそのマクロは無効にしておき、無効なマクロの名前として
+// 読んだトークンには no_expand を付けて、以後も展開しないようにする。
+//
+// 読み込んだヘッダはトークン列ごと保存しておき、2 回目以降の #include では
+// ファイルを読み直さない。全体が #ifndef X ... #endif で囲まれたヘッダや
+// #pragma once のあるヘッダは、2 回目以降は中身を読まずに飛ばす。
+
+#include "compiler.h"
+#include <unistd.h>
+
+// #include の入れ子の深さの上限
+#define MAX_INCLUDE_DEPTH 200
+
+typedef struct {
+    char *name;       // マクロ名のアトム
+    bool defined;     // false なら #undef されている
+    bool is_objlike;  // オブジェクト形式のマクロなら true
+    bool has_paste;   // 本体に ## を含む
+    bool disabled;    // 展開中なので、名前を読んでも展開しない
+    char **params;    // 仮引数名のアトム
+    int nparams;
+    TokenBuf body;
+
+    // トップレベルで展開した結果。memo_gen が macro_gen と等しい間だけ使える
+    TokenBuf memo;
+    bool has_memo;
+    unsigned memo_gen;
+} Macro;
+
+// 展開中のマクロのトークン列
+typedef struct {
+    TokenBuf *buf;
+    int pos;
+    Macro *macro;   // 読み終えたら再び有効にするマクロ
+    bool expanded;  // メモした展開結果なので、もう展開しない
+    bool owned;     // 読み終えたら buf を解放する
+} Context;
+
+typedef struct Header Header;
+
+// 読み込んだヘッダ
+struct Header {
+    Header *next;
+    char *path;     // ファイルのパスのアトム
+    TokenBuf toks;
+    char *guard;    // インクルードガードのマクロ名。なければ NULL
+    bool once;      // #pragma once があった
+};
+
+// 読んでいるファイル
+typedef struct {
+    char *name;
+    Header *header; // 主ファイルなら NULL
+    TokenBuf *buf;
+    int pos;
+    int cond_base;  // このファイルが始まったときの conds の深さ
+} Source;
+
+// #if の入れ子
+typedef struct {
+    enum { IN_THEN, IN_ELIF, IN_ELSE } ctx;
+    Token tok;      // #if などのディレクティブ名
+    bool included;  // いずれかの分岐を取り込んだ
+} Cond;
+
+int nheaders_read;
+int nheaders_cached;
+int nheaders_skipped;
+
+static char **include_paths;
+static int ninclude_paths;
+
+// オープンアドレス法のハッシュ表。容量は常に 2 のべき乗。
+static Macro **macros;
+static int nmacros;
+static int macros_cap;
+
+// #define か #undef のたびに増やす。これが変わるとメモは使えなくなる
+static unsigned macro_gen;
+
+static Context *ctxs;
+static int nctxs;
+static int ctxs_cap;
+
+// expand_tokens() の中では、ctx_base より下の文脈とファイルは読まない
+static int ctx_base;
+static bool isolated;
+
+// read_raw() が最後に返したトークンはメモから読んだ
+static bool raw_expanded;
+
+// トップレベルで展開している、結果をメモするマクロ
+static Macro *recording;
+// 展開がマクロの外のトークンを読んだので、結果をメモできない
+static bool memo_tainted;
+// 関数形式マクロの引数を読んでいる深さ
+static int collecting;
+
+static Source sources[MAX_INCLUDE_DEPTH];
+static int nsources;
+
+static Cond *conds;
+static int nconds;
+static int conds_cap;
+
+static Header *headers;
+
+static char *atom_defined;
+
+static TokenBuf empty_buf;
+
+// 配列 p に n 番目の要素を置けるように広げます。
+static void *reserve(void *p, int *cap, int n, size_t size) {
+    if (n < *cap)
+        return p;
+    *cap = *cap ? *cap * 2 : 16;
+    p = realloc(p, size * *cap);
+    if (!p)
+        error("メモリ不足です");
+    return p;
+}
+
+static void free_tokens(TokenBuf *buf) {
+    free(buf->toks);
+    free(buf->strs);
+    *buf = (TokenBuf){0};
+}
+
+void add_include_path(char *dir) {
+    include_paths = realloc(include_paths, sizeof(char *) * (ninclude_paths + 1));
+    include_paths[ninclude_paths++] = dir;
+}
+
+//
+// マクロ表
+//
+
+static Macro **macro_slot(char *name) {
+    uint64_t hash = (uintptr_t)name * 0x9e3779b97f4a7c15;
+    for (int i = (hash >> 32) & (macros_cap - 1);; i = (i + 1) & (macros_cap - 1))
+        if (!macros[i] || macros[i]->name == name)
+            return &macros[i];
+}
+
+static Macro *find_macro(char *name) {
+    if (!nmacros)
+        return NULL;
+    Macro *m = *macro_slot(name);
+    return m && m->defined ? m : NULL;
+}
+
+// name のマクロを空の本体で定義し直して返します。
+static Macro *add_macro(char *name) {
+    if ((nmacros + 1) * 2 > macros_cap) {
+        Macro **old = macros;
+        int old_cap = macros_cap;
+        macros_cap = macros_cap ? macros_cap * 2 : 64;
+        macros = calloc(macros_cap, sizeof(Macro *));
+        for (int i = 0; i < old_cap; i++)
+            if (old[i])
+                *macro_slot(old[i]->name) = old[i];
+        free(old);
+    }
+
+    Macro **slot = macro_slot(name);
+    if (!*slot) {
+        *slot = calloc(1, sizeof(Macro));
+        (*slot)->name = name;
+        nmacros++;
+    }
+
+    Macro *m = *slot;
+    free_tokens(&m->body);
+    free(m->params);
+    m->params = NULL;
+    m->nparams = 0;
+    m->has_paste = false;
+    m->defined = true;
+    macro_gen++;
+    return m;
+}
+
+static int param_index(Macro *m, Token *tok) {
+    if (tok->kind == TK_IDENT)
+        for (int i = 0; i < m->nparams; i++)
+            if (m->params[i] == tok->name)
+                return i;
+    return -1;
+}
+
+//
+// トークンの読み取り
+//
+
+static Token *source_peek(void) {
+    Source *s = &sources[nsources - 1];
+    if (s->pos == s->buf->len) {
+        if (s->header)
+            return NULL;
+        s->buf = tokenize_batch();
+        s->pos = 0;
+        if (!s->buf->len)
+            return NULL;
+    }
+    return &s->buf->toks[s->pos];
+}
+
+static Token *source_read(TokenBuf **src) {
+    Token *tok = source_peek();
+    if (tok) {
+        Source *s = &sources[nsources - 1];
+        *src = s->buf;
+        s->pos++;
+    }
+    return tok;
+}
+
+static void push_context(TokenBuf *buf, Macro *m, bool expanded, bool owned) {
+    if (m && m->is_objlike && nctxs == 0 && !isolated) {
+        recording = m;
+        memo_tainted = false;
+        m->has_memo = false;
+        m->memo.len = 0;
+        m->memo.nstrs = 0;
+    }
+
+    ctxs = reserve(ctxs, &ctxs_cap, nctxs, sizeof(Context));
+    ctxs[nctxs++] = (Context){buf, 0, m, expanded, owned};
+    if (m)
+        m->disabled = true;
+}
+
+static void pop_context(void) {
+    Context *c = &ctxs[--nctxs];
+    if (c->macro)
+        c->macro->disabled = false;
+    if (c->owned) {
+        free_tokens(c->buf);
+        free(c->buf);
+    }
+
+    if (nctxs == 0 && recording) {
+        if (!memo_tainted && !collecting) {
+            recording->has_memo = true;
+            recording->memo_gen = macro_gen;
+        }
+        recording = NULL;
+    }
+}
+
+// 次のトークンを展開せずに読み、その文字列リテラル表を *src に入れる。
+// 読み終えた文脈は取り除く。ファイルの終わりか行頭の # に達したら NULL を返す。
+static Token *read_raw(TokenBuf **src) {
+    while (nctxs > ctx_base) {
+        Context *c = &ctxs[nctxs - 1];
+        if (c->pos < c->buf->len) {
+            *src = c->buf;
+            raw_expanded = c->expanded;
+            return &c->buf->toks[c->pos++];
+        }
+        pop_context();
+    }
+
+    raw_expanded = false;
+    if (isolated)
+        return NULL;
+
+    // 行頭の # はディレクティブなので preprocess() に任せる
+    Token *tok = source_peek();
+    if (!tok || (tok->id == P_HASH && tok->at_bol))
+        return NULL;
+    return source_read(src);
+}
+
+// 次に read_raw() が返すトークンを読み進めずに返す。
+static Token *peek_raw(void) {
+    for (int i = nctxs - 1; i >= ctx_base; i--)
+        if (ctxs[i].pos < ctxs[i].buf->len)
+            return &ctxs[i].buf->toks[ctxs[i].pos];
+
+    if (isolated)
+        return NULL;
+    if (recording)
+        memo_tainted = true;
+    return source_peek();
+}
+
+//
+// マクロ展開
+//
+
+static Token *expand_next(TokenBuf *out);
+
+static Token *emit(TokenBuf *out, Token *tok, TokenBuf *src) {
+    Token *copy = copy_token(out, tok, src);
+    if (recording && !isolated)
+        copy_token(&recording->memo, copy, out);
+    return copy;
+}
+
+// in を前後のトークンから切り離してマクロ展開し、結果を新しい TokenBuf で返します。
+static TokenBuf *expand_tokens(TokenBuf *in) {
+    int base = ctx_base;
+    bool iso = isolated;
+    ctx_base = nctxs;
+    isolated = true;
+
+    TokenBuf *out = calloc(1, sizeof(TokenBuf));
+    push_context(in, NULL, false, false);
+    while (expand_next(out))
+        ;
+
+    ctx_base = base;
+    isolated = iso;
+    return out;
+}
+
+// text をトークナイズして 1 つのトークンにし、out に追加します。
+// text の後ろには INPUT_PADDING バイトの 0 が続いていなければならない。
+static Token *lex_one(TokenBuf *out, char *text, Token *at) {
+    TokenBuf tmp = {0};
+    tokenize_buffer(&tmp, text);
+    if (tmp.len != 1)
+        error_tok(at, "%s は 1 つのトークンではありません", text);
+
+    Token *tok = copy_token(out, &tmp.toks[0], &tmp);
+    tok->at_bol = false;
+    tok->has_space = at->has_space;
+    free_tokens(&tmp);
+    return tok;
+}
+
+// arg の綴りを文字列リテラルにして out に追加します。
+static void stringize(TokenBuf *out, TokenBuf *arg, Token *hash) {
+    char *buf;
+    size_t buflen;
+    FILE *fp = open_memstream(&buf, &buflen);
+
+    fputc('"', fp);
+    for (int i = 0; i < arg->len; i++) {
+        Token *tok = &arg->toks[i];
+        if (i > 0 && tok->has_space)
+            fputc(' ', fp);
+        for (int j = 0; j < tok->len; j++) {
+            if (tok->kind == TK_STR && (tok->loc[j] == '"' || tok->loc[j] == '\\'))
+                fputc('\\', fp);
+            fputc(tok->loc[j], fp);
+        }
+    }
+    fputc('"', fp);
+
+    static char zero[INPUT_PADDING];
+    fwrite(zero, 1, sizeof(zero), fp);
+    fclose(fp);
+    lex_one(out, buf, hash);
+}
+
+// out の最後のトークンと rhs をつないで 1 つのトークンにします。
+static void paste(TokenBuf *out, Token *rhs) {
+    Token lhs = out->toks[--out->len];
+    char *buf = calloc(1, lhs.len + rhs->len + INPUT_PADDING);
+    memcpy(buf, lhs.loc, lhs.len);
+    memcpy(buf + lhs.len, rhs->loc, rhs->len);
+    lex_one(out, buf, &lhs);
+}
+
+// マクロの本体の仮引数を実引数で置き換え、# と ## を処理したトークン列を返します。
+static TokenBuf *subst(Macro *m, TokenBuf *args) {
+    TokenBuf *body = &m->body;
+    TokenBuf *out = calloc(1, sizeof(TokenBuf));
+    TokenBuf **expanded = calloc(m->nparams + 1, sizeof(TokenBuf *));
+
+    // 最後に置いた項目の先頭。out->len と等しければその項目は空で、
+    // 続く ## の左辺はないものとして扱う。
+    int last = 0;
+
+    for (int i = 0; i < body->len; i++) {
+        Token *tok = &body->toks[i];
+
+        // #x は実引数の綴りを文字列リテラルにする
+        if (tok->id == P_HASH && !m->is_objlike) {
+            int idx = i + 1 < body->len ? param_index(m, tok + 1) : -1;
+            if (idx < 0)
+                error_tok(tok, "'#' の後ろは仮引数でなければなりません");
+            last = out->len;
+            stringize(out, &args[idx], tok);
+            i++;
+            continue;
+        }
+
+        // a ## b は左辺の最後のトークンと右辺の最初のトークンをつなぐ
+        if (tok->id == P_HASHHASH) {
+            if (i == 0 || i + 1 == body->len)
+                error_tok(tok, "'##' の両側にはトークンが必要です");
+            Token *rhs = &body->toks[++i];
+            TokenBuf *src = body;
+            int start = i, end = i + 1;
+            int idx = param_index(m, rhs);
+            if (idx >= 0) {
+                src = &args[idx];
+                start = 0;
+                end = src->len;
+            }
+            if (start == end)
+                continue;
+
+            if (out->len == last)
+                copy_token(out, &src->toks[start], src);
+            else
+                paste(out, &src->toks[start]);
+            for (int j = start + 1; j < end; j++)
+                copy_token(out, &src->toks[j], src);
+            last = out->len - 1;
+            continue;
+        }
+
+        // 仮引数は、## の左辺でなければマクロ展開した実引数に置き換える
+        int idx = param_index(m, tok);
+        if (idx >= 0) {
+            TokenBuf *arg = &args[idx];
+            if (i + 1 == body->len || body->toks[i + 1].id != P_HASHHASH) {
+                if (!expanded[idx])
+                    expanded[idx] = expand_tokens(arg);
+                arg = expanded[idx];
+            }
+            last = out->len;
+            for (int j = 0; j < arg->len; j++)
+                copy_token(out, &arg->toks[j], arg);
+            continue;
+        }
+
+        last = out->len;
+        copy_token(out, tok, body);
+    }
+
+    for (int i = 0; i < m->nparams; i++) {
+        if (expanded[i]) {
+            free_tokens(expanded[i]);
+            free(expanded[i]);
+        }
+    }
+    free(expanded);
+    return out;
+}
+
+// 関数形式マクロの実引数を読み取ります。'(' は読み終えている。
+static TokenBuf *collect_args(Macro *m, Token *name) {
+    int max = m->nparams ? m->nparams : 1;
+    TokenBuf *args = calloc(max, sizeof(TokenBuf));
+    int nargs = 0;
+    int depth = 0;
+
+    collecting++;
+    for (;;) {
+        TokenBuf *src;
+        Token *tok = read_raw(&src);
+        if (!tok)
+            error_tok(name, "マクロ呼び出しが閉じていません");
+
+        if (depth == 0 && tok->id == P_RPAREN)
+            break;
+        if (depth == 0 && tok->id == P_COMMA) {
+            if (++nargs == max)
+                error_tok(tok, "マクロの引数が多すぎます");
+            continue;
+        }
+
+        if (tok->id == P_LPAREN)
+            depth++;
+        else if (tok->id == P_RPAREN)
+            depth--;
+        copy_token(&args[nargs], tok, src);
+    }
+    collecting--;
+
+    if (nargs + 1 < m->nparams)
+        error_tok(name, "マクロの引数が足りません");
+    return args;
+}
+
+// マクロ m を展開して文脈に積みます。
+// 関数形式のマクロの名前の後ろに '(' が続かなければ、展開せずに false を返す。
+static bool expand_macro(Macro *m, Token *name) {
+    if (m->is_objlike) {
+        if (nctxs == 0 && !isolated && m->has_memo && m->memo_gen == macro_gen)
+            push_context(&m->memo, NULL, true, false);
+        else if (m->has_paste)
+            push_context(subst(m, NULL), m, false, true);
+        else
+            push_context(&m->body, m, false, false);
+        return true;
+    }
+
+    Token *next = peek_raw();
+    if (!next || next->id != P_LPAREN)
+        return false;
+
+    TokenBuf *src;
+    read_raw(&src);
+    TokenBuf *args = collect_args(m, name);
+    push_context(subst(m, args), m, false, true);
+
+    for (int i = 0; i < m->nparams; i++)
+        free_tokens(&args[i]);
+    free(args);
+    return true;
+}
+
+// 次のトークンをマクロ展開して out に追加し、それを返す。
+// ファイルの終わりか行頭の # に達したら NULL を返す。
+static Token *expand_next(TokenBuf *out) {
+    for (;;) {
+        TokenBuf *src;
+        Token *tok = read_raw(&src);
+        if (!tok)
+            return NULL;
+
+        if (tok->kind != TK_IDENT || tok->no_expand || raw_expanded)
+            return emit(out, tok, src);
+
+        Macro *m = find_macro(tok->name);
+        if (!m)
+            return emit(out, tok, src);
+
+        // 展開中のマクロの名前は、以後も展開しない
+        Token name = *tok;
+        if (m->disabled) {
+            name.no_expand = true;
+            return emit(out, &name, NULL);
+        }
+
+        if (!expand_macro(m, &name))
+            return emit(out, &name, NULL);
+    }
+}
+
+//
+// #if の式
+//
+
+static long eval_cond(Token **rest, Token *tok);
+
+static long eval_primary(Token **rest, Token *tok) {
+    if (tok->id == P_LPAREN) {
+        long val = eval_cond(&tok, tok + 1);
+        *rest = skip(tok, P_RPAREN);
+        return val;
+    }
+
+    if (tok->kind == TK_NUM) {
+        *rest = tok + 1;
+        return tok->val;
+    }
+
+    error_tok(tok, "式が必要です");
+    return 0;
+}
+
+static long eval_unary(Token **rest, Token *tok) {
+    switch (tok->id) {
+    case P_PLUS:
+        return eval_unary(rest, tok + 1);
+    case P_MINUS:
+        return -eval_unary(rest, tok + 1);
+    case P_NOT:
+        return !eval_unary(rest, tok + 1);
+    case P_TILDE:
+        return ~eval_unary(rest, tok + 1);
+    default:
+        return eval_primary(rest, tok);
+    }
+}
+
+// 二項演算子の優先順位。大きいほど強く結合する。二項演算子でなければ 0。
+static int binary_prec(Token *tok) {
+    switch (tok->id) {
+    case P_OROR: return 1;
+    case P_ANDAND: return 2;
+    case P_PIPE: return 3;
+    case P_CARET: return 4;
+    case P_AMP: return 5;
+    case P_EQ: case P_NE: return 6;
+    case P_LT: case P_LE: case P_GT: case P_GE: return 7;
+    case P_SHL: case P_SHR: return 8;
+    case P_PLUS: case P_MINUS: return 9;
+    case P_STAR: case P_SLASH: case P_PERCENT: return 10;
+    default: return 0;
+    }
+}
+
+// 優先順位が min_prec 以上の二項演算子からなる式を評価する
+static long eval_binary(Token **rest, Token *tok, int min_prec) {
+    long lhs = eval_unary(&tok, tok);
+
+    for (int prec; (prec = binary_prec(tok)) >= min_prec;) {
+        Token *op = tok;
+        long rhs = eval_binary(&tok, tok + 1, prec + 1);
+
+        switch (op->id) {
+        case P_OROR: lhs = lhs || rhs; break;
+        case P_ANDAND: lhs = lhs && rhs; break;
+        case P_PIPE: lhs |= rhs; break;
+        case P_CARET: lhs ^= rhs; break;
+        case P_AMP: lhs &= rhs; break;
+        case P_EQ: lhs = lhs == rhs; break;
+        case P_NE: lhs = lhs != rhs; break;
+        case P_LT: lhs = lhs < rhs; break;
+        case P_LE: lhs = lhs <= rhs; break;
+        case P_GT: lhs = lhs > rhs; break;
+        case P_GE: lhs = lhs >= rhs; break;
+        case P_SHL: lhs <<= rhs; break;
+        case P_SHR: lhs >>= rhs; break;
+        case P_PLUS: lhs += rhs; break;
+        case P_MINUS: lhs -= rhs; break;
+        case P_STAR: lhs *= rhs; break;
+        case P_SLASH:
+        case P_PERCENT:
+            if (rhs == 0)
+                error_tok(op, "ゼロで割っています");
+            lhs = op->id == P_SLASH ? lhs / rhs : lhs % rhs;
+            break;
+        }
+    }
+
+    *rest = tok;
+    return lhs;
+}
+
+// cond = binary ("?" cond ":" cond)?
+static long eval_cond(Token **rest, Token *tok) {
+    long val = eval_binary(&tok, tok, 1);
+    if (tok->id == P_QUESTION) {
+        long then = eval_cond(&tok, tok + 1);
+        tok = skip(tok, P_COLON);
+        long els = eval_cond(&tok, tok);
+        val = val ? then : els;
+    }
+    *rest = tok;
+    return val;
+}
+
+static void set_num(Token *tok, int val) {
+    tok->kind = TK_NUM;
+    tok->id = ID_NONE;
+    tok->val = val;
+}
+
+// #if や #elif の行を評価します。line の末尾は TK_EOF。
+static long eval_line(TokenBuf *line, Token *dir) {
+    // defined X と defined(X) を 1 か 0 に置き換えてからマクロを展開する
+    TokenBuf pre = {0};
+    for (Token *tok = line->toks; tok->kind != TK_EOF; tok++) {
+        if (tok->kind != TK_IDENT || tok->name != atom_defined) {
+            copy_token(&pre, tok, line);
+            continue;
+        }
+
+        Token *start = tok;
+        bool paren = consume(&tok, tok + 1, P_LPAREN);
+        if (tok->kind != TK_IDENT)
+            error_tok(tok, "マクロ名が必要です");
+        int val = find_macro(tok->name) != NULL;
+        if (paren)
+            tok = skip(tok + 1, P_RPAREN) - 1;
+        set_num(copy_token(&pre, start, NULL), val);
+    }
+    copy_token(&pre, &line->toks[line->len - 1], NULL);
+
+    TokenBuf *expr = expand_tokens(&pre);
+    free_tokens(&pre);
+
+    // 展開されずに残った識別子は 0 とみなす
+    for (int i = 0; i < expr->len; i++)
+        if (expr->toks[i].kind == TK_IDENT || expr->toks[i].kind == TK_KEYWORD)
+            set_num(&expr->toks[i], 0);
+
+    Token *tok = expr->toks;
+    if (tok->kind == TK_EOF)
+        error_tok(dir, "式が必要です");
+    long val = eval_cond(&tok, tok);
+    if (tok->kind != TK_EOF)
+        error_tok(tok, "余分なトークンがあります");
+
+    free_tokens(expr);
+    free(expr);
+    return val;
+}
+
+//
+// ディレクティブ
+//
+
+// 行の残りのトークンを line に複製し、末尾に TK_EOF を置きます。
+static void read_line(TokenBuf *line, Token *dir) {
+    char *end = dir->loc + dir->len;
+    for (Token *tok; (tok = source_peek()) && !tok->at_bol;) {
+        end = tok->loc + tok->len;
+        copy_token(line, tok, sources[nsources - 1].buf);
+        sources[nsources - 1].pos++;
+    }
+
+    Token eof = {.loc = end, .kind = TK_EOF};
+    copy_token(line, &eof, NULL);
+}
+
+static bool file_exists(char *path) {
+    return access(path, R_OK) == 0;
+}
+
+static char *dir_of(char *path) {
+    char *slash = strrchr(path, '/');
+    return slash ? format("%.*s", (int)(slash - path), path) : ".";
+}
+
+static char *search_include(char *name, bool quoted) {
+    if (name[0] == '/')
+        return file_exists(name) ? name : NULL;
+
+    // "..." はまずインクルードしたファイルと同じディレクトリから探す
+    if (quoted) {
+        char *path = format("%s/%s", dir_of(sources[nsources - 1].name), name);
+        if (file_exists(path))
+            return path;
+    }
+
+    for (int i = 0; i < ninclude_paths; i++) {
+        char *path = format("%s/%s", include_paths[i], name);
+        if (file_exists(path))
+            return path;
+    }
+    return NULL;
+}
+
+// ヘッダのトークン列から、全体を囲む #ifndef X / #define X ... #endif を探して
+// X を返します。#ifndef に対応する #else や #elif があればガードとはみなさない。
+static char *detect_guard(TokenBuf *buf) {
+    Token *tok = buf->toks;
+    int len = buf->len;
+    if (len < 6 || tok[0].id != P_HASH || !equal(&tok[1], "ifndef") || tok[2].kind != TK_IDENT)
+        return NULL;
+    if (tok[3].id != P_HASH || !tok[3].at_bol || !equal(&tok[4], "define") ||
+        tok[4].at_bol || tok[5].kind != TK_IDENT || tok[5].name != tok[2].name)
+        return NULL;
+
+    int depth = 0;
+    for (int i = 6; i + 1 < len; i++) {
+        if (tok[i].id != P_HASH || !tok[i].at_bol || tok[i + 1].at_bol)
+            continue;
+
+        Token *dir = &tok[i + 1];
+        if (equal(dir, "if") || equal(dir, "ifdef") || equal(dir, "ifndef")) {
+            depth++;
+        } else if ((equal(dir, "else") || equal(dir, "elif")) && depth == 0) {
+            return NULL;
+        } else if (equal(dir, "endif") && depth-- == 0) {
+            // #endif の行より後ろにトークンがなければガード
+            for (int j = i + 2; j < len; j++)
+                if (tok[j].at_bol)
+                    return NULL;
+            return tok[2].name;
+        }
+    }
+    return NULL;
+}
+
+static void push_header(char *path, Token *dir) {
+    if (nsources == MAX_INCLUDE_DEPTH)
+        error_tok(dir, "#include の入れ子が深すぎます");
+
+    char *key = intern(path, strlen(path));
+    Header *h = headers;
+    while (h && h->path != key)
+        h = h->next;
+
+    if (h) {
+        if (h->once || (h->guard && find_macro(h->guard))) {
+            nheaders_skipped++;
+            return;
+        }
+        nheaders_cached++;
+    } else {
+        h = calloc(1, sizeof(Header));
+        h->path = key;
+        tokenize_buffer(&h->toks, load_file(path)->contents);
+        h->guard = detect_guard(&h->toks);
+        h->next = headers;
+        headers = h;
+        nheaders_read++;
+    }
+
+    sources[nsources++] = (Source){
+        .name = path, .header = h, .buf = &h->toks, .cond_base = nconds,
+    };
+}
+
+// #include の行を読みます。expand が true なら、どちらの形式でもない行を
+// マクロ展開してからもう一度試す。
+static void include_file(TokenBuf *line, Token *dir, bool expand) {
+    Token *tok = line->toks;
+    char *name;
+    bool quoted = false;
+
+    if (tok->kind == TK_STR) {
+        // #include "foo.h"
+        name = line->strs[tok->str].str;
+        quoted = true;
+    } else if (tok->id == P_LT) {
+        // #include <foo.h>
+        char *buf;
+        size_t buflen;
+        FILE *fp = open_memstream(&buf, &buflen);
+        for (tok++; tok->id != P_GT; tok++) {
+            if (tok->kind == TK_EOF)
+                error_tok(tok, "'>' が必要です");
+            if (tok != line->toks + 1 && tok->has_space)
+                fputc(' ', fp);
+            fwrite(tok->loc, 1, tok->len, fp);
+        }
+        fclose(fp);
+        name = buf;
+    } else if (expand) {
+        // #include FOO
+        TokenBuf *expanded = expand_tokens(line);
+        include_file(expanded, dir, false);
+        return;
+    } else {
+        error_tok(tok, "ファイル名が必要です");
+        return;
+    }
+
+    char *path = search_include(name, quoted);
+    if (!path)
+        error_tok(line->toks, "%s: ヘッダファイルが見つかりません", name);
+    push_header(path, dir);
+}
+
+static void define_macro(TokenBuf *line) {
+    Token *tok = line->toks;
+    if (tok->kind != TK_IDENT)
+        error_tok(tok, "マクロ名は識別子でなければなりません");
+    Macro *m = add_macro(tok->name);
+    tok++;
+
+    // 名前の直後に空白なしで '(' が続けば関数形式のマクロ
+    m->is_objlike = tok->id != P_LPAREN || tok->has_space;
+    if (!m->is_objlike) {
+        int cap = 0;
+        tok++;
+        while (tok->id != P_RPAREN) {
+            if (m->nparams > 0)
+                tok = skip(tok, P_COMMA);
+            if (tok->kind != TK_IDENT)
+                error_tok(tok, "仮引数の名前が必要です");
+            m->params = reserve(m->params, &cap, m->nparams, sizeof(char *));
+            m->params[m->nparams++] = tok->name;
+            tok++;
+        }
+        tok++;
+    }
+
+    for (; tok->kind != TK_EOF; tok++) {
+        copy_token(&m->body, tok, line);
+        if (tok->id == P_HASHHASH)
+            m->has_paste = true;
+    }
+}
+
+static void push_cond(Token *dir, bool included) {
+    conds = reserve(conds, &conds_cap, nconds, sizeof(Cond));
+    conds[nconds++] = (Cond){IN_THEN, *dir, included};
+}
+
+// 偽の分岐を読み飛ばし、それを終わらせる #elif, #else, #endif の名前を *dir に入れる。
+static void skip_cond_incl(Token *dir) {
+    int depth = 0;
+    for (;;) {
+        TokenBuf *src;
+        Token *tok = source_read(&src);
+        if (!tok)
+            error_tok(&conds[nconds - 1].tok, "対応する #endif がありません");
+        if (tok->id != P_HASH || !tok->at_bol)
+            continue;
+
+        Token *name = source_peek();
+        if (!name || name->at_bol)
+            continue;
+
+        if (equal(name, "if") || equal(name, "ifdef") || equal(name, "ifndef")) {
+            depth++;
+        } else if (depth > 0) {
+            if (equal(name, "endif"))
+                depth--;
+        } else if (equal(name, "elif") || equal(name, "else") || equal(name, "endif")) {
+            *dir = *name;
+            sources[nsources - 1].pos++;
+            return;
+        }
+    }
+}
+
+// 取り込まない分岐を読み飛ばし、次に取り込む分岐の先頭か、#endif の後ろまで進みます。
+static void skip_branches(void) {
+    for (;;) {
+        Token dir;
+        skip_cond_incl(&dir);
+        TokenBuf line = {0};
+        read_line(&line, &dir);
+        Cond *cond = &conds[nconds - 1];
+
+        if (equal(&dir, "endif")) {
+            nconds--;
+            free_tokens(&line);
+            return;
+        }
+
+        if (cond->ctx == IN_ELSE)
+            error_tok(&dir, "#else の後ろに #%.*s があります", dir.len, dir.loc);
+
+        bool take;
+        if (equal(&dir, "else")) {
+            cond->ctx = IN_ELSE;
+            take = !cond->included;
+        } else {
+            cond->ctx = IN_ELIF;
+            take = !cond->included && eval_line(&line, &dir);
+        }
+        free_tokens(&line);
+
+        if (take) {
+            cond->included = true;
+            return;
+        }
+    }
+}
+
+// #elif, #else, #endif に対応する #if を返します。
+static Cond *current_cond(Token *dir) {
+    if (nconds == sources[nsources - 1].cond_base)
+        error_tok(dir, "対応する #if がありません");
+    Cond *cond = &conds[nconds - 1];
+    if (cond->ctx == IN_ELSE && !equal(dir, "endif"))
+        error_tok(dir, "#else の後ろに #%.*s があります", dir->len, dir->loc);
+    return cond;
+}
+
+// 行頭の # に続くディレクティブを処理します。# は読み終えている。
+static void directive(void) {
+    Token *tok = source_peek();
+    if (!tok || tok->at_bol)
+        return; // 空のディレクティブ
+
+    Token dir = *tok;
+    sources[nsources - 1].pos++;
+    TokenBuf line = {0};
+    read_line(&line, &dir);
+    Token *arg = line.toks;
+
+    if (equal(&dir, "include")) {
+        include_file(&line, &dir, true);
+    } else if (equal(&dir, "define")) {
+        define_macro(&line);
+    } else if (equal(&dir, "undef")) {
+        if (arg->kind != TK_IDENT)
+            error_tok(arg, "マクロ名は識別子でなければなりません");
+        Macro *m = find_macro(arg->name);
+        if (m) {
+            m->defined = false;
+            macro_gen++;
+        }
+    } else if (equal(&dir, "if")) {
+        bool val = eval_line(&line, &dir);
+        push_cond(&dir, val);
+        if (!val)
+            skip_branches();
+    } else if (equal(&dir, "ifdef") || equal(&dir, "ifndef")) {
+        if (arg->kind != TK_IDENT)
+            error_tok(arg, "マクロ名が必要です");
+        bool val = (find_macro(arg->name) != NULL) == equal(&dir, "ifdef");
+        push_cond(&dir, val);
+        if (!val)
+            skip_branches();
+    } else if (equal(&dir, "elif") || equal(&dir, "else")) {
+        // 前の分岐を取り込んだので、残りの分岐はすべて読み飛ばす
+        Cond *cond = current_cond(&dir);
+        cond->ctx = equal(&dir, "else") ? IN_ELSE : IN_ELIF;
+        skip_branches();
+    } else if (equal(&dir, "endif")) {
+        current_cond(&dir);
+        nconds--;
+    } else if (equal(&dir, "pragma")) {
+        if (equal(arg, "once") && sources[nsources - 1].header)
+            sources[nsources - 1].header->once = true;
+    } else if (equal(&dir, "error")) {
+        char *end = line.toks[line.len - 1].loc;
+        error_tok(&dir, "#error%.*s", (int)(end - dir.loc - dir.len), dir.loc + dir.len);
+    } else {
+        error_tok(&dir, "不正なディレクティブです");
+    }
+
+    free_tokens(&line);
+}
+
+void init_preprocess(File *file) {
+    atom_defined = intern("defined", 7);
+    sources[0] = (Source){.name = file->name, .buf = &empty_buf};
+    nsources = 1;
+}
+
+// 次のトークンをプリプロセスして out に追加し、それを返します。
+// 主ファイルの終わりに達したら NULL を返す。
+Token *preprocess(TokenBuf *out) {
+    for (;;) {
+        // 展開中のマクロがなければ、ディレクティブでもマクロでもないトークンは
+        // ファイルのトークン列からそのまま渡す
+        Source *s = &sources[nsources - 1];
+        if (nctxs == 0 && s->pos < s->buf->len) {
+            Token *tok = &s->buf->toks[s->pos];
+            bool is_macro = tok->kind == TK_IDENT && find_macro(tok->name);
+            if (!is_macro && !(tok->id == P_HASH && tok->at_bol)) {
+                s->pos++;
+                return copy_token(out, tok, s->buf);
+            }
+        }
+
+        Token *tok = expand_next(out);
+        if (tok)
+            return tok;
+
+        // 行頭の # か、ファイルの終わり
+        if (source_peek()) {
+            sources[nsources - 1].pos++;
+            directive();
+            continue;
+        }
+
+        if (nconds > sources[nsources - 1].cond_base)
+            error_tok(&conds[nconds - 1].tok, "対応する #endif がありません");
+        if (nsources == 1)
+            return NULL;
+        nsources--;
+    }
+}
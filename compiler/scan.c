@@ -0,0 +1,297 @@
+// トークナイザが使う文字走査カーネル。
+//
+// 空白の読み飛ばし、識別子・数字の終端探し、コメントや文字列リテラルの
+// 終端探しを 16 バイト (SSE2) または 32 バイト (AVX2) ずつまとめて行う。
+// どの命令セットを使うかは init_scan() が実行時に CPU を調べて決める。
+//
+// 各カーネルは入力の終端 '\0' の後ろまで最大 INPUT_PADDING バイトを
+// 一度に読み込むことがある。read_file() は入力の後ろに必ずその分の
+// 0 を置くので、バッファの外を読むことはない。
+
+#include "compiler.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+char *(*skip_space)(char *p);
+char *(*skip_ident)(char *p);
+char *(*skip_digits)(char *p);
+char *(*find_line_end)(char *p);
+char *(*find_comment_end)(char *p);
+char *(*find_string_special)(char *p);
+
+//
+// スカラー実装
+//
+
+static bool is_space(char c) {
+    return c == ' ' || ('\t' <= c && c <= '\r');
+}
+
+static bool is_ident_char(char c) {
+    return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') ||
+           ('0' <= c && c <= '9') || c == '_';
+}
+
+static char *skip_space_scalar(char *p) {
+    while (is_space(*p))
+        p++;
+    return p;
+}
+
+static char *skip_ident_scalar(char *p) {
+    while (is_ident_char(*p))
+        p++;
+    return p;
+}
+
+static char *skip_digits_scalar(char *p) {
+    while ('0' <= *p && *p <= '9')
+        p++;
+    return p;
+}
+
+static char *find_line_end_scalar(char *p) {
+    while (*p && *p != '\n')
+        p++;
+    return p;
+}
+
+static char *find_comment_end_scalar(char *p) {
+    for (; *p; p++)
+        if (p[0] == '*' && p[1] == '/')
+            return p;
+    return NULL;
+}
+
+static char *find_string_special_scalar(char *p) {
+    while (*p && *p != '"' && *p != '\\' && *p != '\n')
+        p++;
+    return p;
+}
+
+#if defined(__x86_64__)
+
+//
+// SSE2 実装
+//
+
+// x <= hi (符号なし比較) となるバイトを 0xff にする
+static __m128i le_u8_128(__m128i x, int hi) {
+    return _mm_cmpeq_epi8(_mm_min_epu8(x, _mm_set1_epi8(hi)), x);
+}
+
+// lo <= x <= hi となるバイトを 0xff にする
+static __m128i in_range_128(__m128i x, char lo, char hi) {
+    return le_u8_128(_mm_sub_epi8(x, _mm_set1_epi8(lo)), hi - lo);
+}
+
+static __m128i eq_128(__m128i x, char c) {
+    return _mm_cmpeq_epi8(x, _mm_set1_epi8(c));
+}
+
+static __m128i load_128(char *p) {
+    return _mm_loadu_si128((__m128i *)p);
+}
+
+static unsigned space_mask_128(char *p) {
+    __m128i v = load_128(p);
+    __m128i m = _mm_or_si128(eq_128(v, ' '), in_range_128(v, '\t', '\r'));
+    return _mm_movemask_epi8(m);
+}
+
+static unsigned ident_mask_128(char *p) {
+    __m128i v = load_128(p);
+    __m128i m = _mm_or_si128(in_range_128(v, '0', '9'), eq_128(v, '_'));
+    m = _mm_or_si128(m, in_range_128(_mm_or_si128(v, _mm_set1_epi8(0x20)), 'a', 'z'));
+    return _mm_movemask_epi8(m);
+}
+
+static char *skip_space_sse2(char *p) {
+    for (;; p += 16) {
+        unsigned m = ~space_mask_128(p) & 0xffff;
+        if (m)
+            return p + __builtin_ctz(m);
+    }
+}
+
+static char *skip_ident_sse2(char *p) {
+    for (;; p += 16) {
+        unsigned m = ~ident_mask_128(p) & 0xffff;
+        if (m)
+            return p + __builtin_ctz(m);
+    }
+}
+
+static char *skip_digits_sse2(char *p) {
+    for (;; p += 16) {
+        unsigned m = ~_mm_movemask_epi8(in_range_128(load_128(p), '0', '9')) & 0xffff;
+        if (m)
+            return p + __builtin_ctz(m);
+    }
+}
+
+static char *find_line_end_sse2(char *p) {
+    for (;; p += 16) {
+        __m128i v = load_128(p);
+        unsigned m = _mm_movemask_epi8(_mm_or_si128(eq_128(v, '\n'), eq_128(v, '\0')));
+        if (m)
+            return p + __builtin_ctz(m);
+    }
+}
+
+static char *find_comment_end_sse2(char *p) {
+    for (;; p += 16) {
+        __m128i v = load_128(p);
+        unsigned end = _mm_movemask_epi8(_mm_and_si128(eq_128(v, '*'), eq_128(load_128(p + 1), '/')));
+        unsigned nul = _mm_movemask_epi8(eq_128(v, '\0'));
+        if (end | nul) {
+            // "*/" より前に '\0' があればコメントは閉じていない
+            if (end && (!nul || __builtin_ctz(end) < __builtin_ctz(nul)))
+                return p + __builtin_ctz(end);
+            return NULL;
+        }
+    }
+}
+
+static char *find_string_special_sse2(char *p) {
+    for (;; p += 16) {
+        __m128i v = load_128(p);
+        __m128i m = _mm_or_si128(eq_128(v, '"'), eq_128(v, '\\'));
+        m = _mm_or_si128(m, _mm_or_si128(eq_128(v, '\n'), eq_128(v, '\0')));
+        unsigned mask = _mm_movemask_epi8(m);
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+}
+
+//
+// AVX2 実装
+//
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static __m256i le_u8_256(__m256i x, int hi) {
+    return _mm256_cmpeq_epi8(_mm256_min_epu8(x, _mm256_set1_epi8(hi)), x);
+}
+
+AVX2 static __m256i in_range_256(__m256i x, char lo, char hi) {
+    return le_u8_256(_mm256_sub_epi8(x, _mm256_set1_epi8(lo)), hi - lo);
+}
+
+AVX2 static __m256i eq_256(__m256i x, char c) {
+    return _mm256_cmpeq_epi8(x, _mm256_set1_epi8(c));
+}
+
+AVX2 static __m256i load_256(char *p) {
+    return _mm256_loadu_si256((__m256i *)p);
+}
+
+AVX2 static char *skip_space_avx2(char *p) {
+    for (;; p += 32) {
+        __m256i v = load_256(p);
+        __m256i m = _mm256_or_si256(eq_256(v, ' '), in_range_256(v, '\t', '\r'));
+        unsigned mask = ~_mm256_movemask_epi8(m);
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+}
+
+AVX2 static char *skip_ident_avx2(char *p) {
+    for (;; p += 32) {
+        __m256i v = load_256(p);
+        __m256i m = _mm256_or_si256(in_range_256(v, '0', '9'), eq_256(v, '_'));
+        m = _mm256_or_si256(m, in_range_256(_mm256_or_si256(v, _mm256_set1_epi8(0x20)), 'a', 'z'));
+        unsigned mask = ~_mm256_movemask_epi8(m);
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+}
+
+AVX2 static char *skip_digits_avx2(char *p) {
+    for (;; p += 32) {
+        unsigned mask = ~_mm256_movemask_epi8(in_range_256(load_256(p), '0', '9'));
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+}
+
+AVX2 static char *find_line_end_avx2(char *p) {
+    for (;; p += 32) {
+        __m256i v = load_256(p);
+        unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(eq_256(v, '\n'), eq_256(v, '\0')));
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+}
+
+AVX2 static char *find_comment_end_avx2(char *p) {
+    for (;; p += 32) {
+        __m256i v = load_256(p);
+        unsigned end = _mm256_movemask_epi8(_mm256_and_si256(eq_256(v, '*'), eq_256(load_256(p + 1), '/')));
+        unsigned nul = _mm256_movemask_epi8(eq_256(v, '\0'));
+        if (end | nul) {
+            if (end && (!nul || __builtin_ctz(end) < __builtin_ctz(nul)))
+                return p + __builtin_ctz(end);
+            return NULL;
+        }
+    }
+}
+
+AVX2 static char *find_string_special_avx2(char *p) {
+    for (;; p += 32) {
+        __m256i v = load_256(p);
+        __m256i m = _mm256_or_si256(eq_256(v, '"'), eq_256(v, '\\'));
+        m = _mm256_or_si256(m, _mm256_or_si256(eq_256(v, '\n'), eq_256(v, '\0')));
+        unsigned mask = _mm256_movemask_epi8(m);
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+}
+
+#endif // __x86_64__
+
+// 使用するカーネルを名前 ("scalar", "sse2", "avx2") で選びます。
+// この CPU で使えない場合は false を返す。
+bool set_scan_isa(char *isa) {
+    if (!strcmp(isa, "scalar")) {
+        skip_space = skip_space_scalar;
+        skip_ident = skip_ident_scalar;
+        skip_digits = skip_digits_scalar;
+        find_line_end = find_line_end_scalar;
+        find_comment_end = find_comment_end_scalar;
+        find_string_special = find_string_special_scalar;
+        return true;
+    }
+
+#if defined(__x86_64__)
+    if (!strcmp(isa, "sse2")) {
+        skip_space = skip_space_sse2;
+        skip_ident = skip_ident_sse2;
+        skip_digits = skip_digits_sse2;
+        find_line_end = find_line_end_sse2;
+        find_comment_end = find_comment_end_sse2;
+        find_string_special = find_string_special_sse2;
+        return true;
+    }
+
+    __builtin_cpu_init();
+    if (!strcmp(isa, "avx2") && __builtin_cpu_supports("avx2")) {
+        skip_space = skip_space_avx2;
+        skip_ident = skip_ident_avx2;
+        skip_digits = skip_digits_avx2;
+        find_line_end = find_line_end_avx2;
+        find_comment_end = find_comment_end_avx2;
+        find_string_special = find_string_special_avx2;
+        return true;
+    }
+#endif
+    return false;
+}
+
+// この CPU で使える最も幅の広いカーネルを選びます。
+void init_scan(void) {
+    if (!set_scan_isa("avx2") && !set_scan_isa("sse2"))
+        set_scan_isa("scalar");
+}
@@ -0,0 +1,215 @@
+// ソースマネージャ。
+//
+// 入力ファイルとインクルードしたヘッダの内容を読み込んで保持し、ソース中の
+// 位置 (char *) からファイル名、行番号、桁を求める。行の先頭位置の表は
+// 最初に問い合わせたときにファイルごとに 1 度だけ作り、以後は二分探索で引く。
+
+#include "compiler.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// 読み込んだすべてのファイル
+static File **files;
+static int nfiles;
+
+// 標準入力など mmap できない入力を最後まで読み取ります。
+static char *read_stream(FILE *fp, size_t *size) {
+    char *buf;
+    size_t buflen;
+    FILE *out = open_memstream(&buf, &buflen);
+
+    // ファイル全体を読み込む。
+    for (;;) {
+        char buf2[4096];
+        int n = fread(buf2, 1, sizeof(buf2), fp);
+        if (n == 0)
+            break;
+        fwrite(buf2, 1, n, out);
+    }
+
+    *size = ftell(out);
+
+    // 末尾に '\0' を含む INPUT_PADDING バイトの 0 を置く。
+    static char zero[INPUT_PADDING];
+    fwrite(zero, 1, sizeof(zero), out);
+    fclose(out);
+    return buf;
+}
+
+// 通常ファイルを読み取り専用で mmap します。
+// トークナイザは '\0' を入力の終わりとして扱い、走査カーネルは終端の先まで
+// まとめて読むため、ファイルの直後に INPUT_PADDING バイトの 0 が続くようにする。
+// 最後のページの余りが足りない場合は、/dev/zero で確保した領域の先頭に
+// ファイルを重ねてマップする。
+static char *map_file(char *path, int fd, size_t size) {
+    size_t pagesz = sysconf(_SC_PAGESIZE);
+
+    if (size % pagesz != 0 && pagesz - size % pagesz >= INPUT_PADDING) {
+        char *buf = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (buf == MAP_FAILED)
+            error("cannot mmap %s: %s", path, strerror(errno));
+        return buf;
+    }
+
+    size_t maplen = size + INPUT_PADDING;
+    int zero = open("/dev/zero", O_RDONLY);
+    if (zero == -1)
+        error("cannot open /dev/zero: %s", strerror(errno));
+    char *buf = mmap(NULL, maplen, PROT_READ, MAP_PRIVATE, zero, 0);
+    close(zero);
+    if (buf == MAP_FAILED)
+        error("cannot mmap %s: %s", path, strerror(errno));
+
+    if (size > 0 &&
+        mmap(buf, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+        error("cannot mmap %s: %s", path, strerror(errno));
+    return buf;
+}
+
+// 指定されたファイルの内容を読み取ります。
+// 通常ファイルはコピーせずに mmap し、それ以外はストリームとして読み込む。
+static char *read_file(char *path, size_t *size) {
+    // 指定されたファイル名が 「-」 の場合は標準入力から読み取る
+    if (strcmp(path, "-") == 0)
+        return read_stream(stdin, size);
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        error("cannot open %s: %s", path, strerror(errno));
+
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        error("cannot stat %s: %s", path, strerror(errno));
+
+    if (!S_ISREG(st.st_mode)) {
+        FILE *fp = fdopen(fd, "r");
+        if (!fp)
+            error("cannot open %s: %s", path, strerror(errno));
+        char *buf = read_stream(fp, size);
+        fclose(fp);
+        return buf;
+    }
+
+    *size = st.st_size;
+    char *buf = map_file(path, fd, st.st_size);
+    close(fd);
+    return buf;
+}
+
+
+// ファイルを読み込み、位置から引けるように登録します。
+File *load_file(char *path) {
+    File *file = calloc(1, sizeof(File));
+    file->name = path;
+    file->index = nfiles;
+    file->contents = read_file(path, &file->size);
+
+    files = realloc(files, sizeof(File *) * (nfiles + 1));
+    if (!files)
+        error("メモリ不足です");
+    files[nfiles++] = file;
+    return file;
+}
+
+// 読み込んだすべてのファイルを、読み込んだ順に返します。
+File **get_files(int *len) {
+    *len = nfiles;
+    return files;
+}
+
+// loc を含むファイルを返します。
+// マクロの # や ## で作ったトークンのように、どのファイルにもなければ NULL を返す。
+File *find_file(char *loc) {
+    for (int i = 0; i < nfiles; i++)
+        if (files[i]->contents <= loc && loc <= files[i]->contents + files[i]->size)
+            return files[i];
+    return NULL;
+}
+
+// 各行の先頭のオフセットの表を作る。
+// 改行は走査カーネルで探すので、長い行もまとめて読み飛ばせる。
+static void build_line_table(File *file) {
+    int cap = 1024;
+    size_t *starts = malloc(sizeof(size_t) * cap);
+    int n = 0;
+    starts[n++] = 0;
+
+    char *end = file->contents + file->size;
+    for (char *p = find_line_end(file->contents); p < end; p = find_line_end(p + 1)) {
+        // 内容の途中に '\0' があれば、そこを改行と同じように扱って先へ進む
+        if (*p != '\n')
+            continue;
+        if (n == cap) {
+            cap *= 2;
+            starts = realloc(starts, sizeof(size_t) * cap);
+            if (!starts)
+                error("メモリ不足です");
+        }
+        starts[n++] = p + 1 - file->contents;
+    }
+
+    file->line_starts = starts;
+    file->nlines = n;
+}
+
+// file の中の loc の行番号と桁 (どちらも 1 から数える) を求めます。
+void get_location(File *file, char *loc, int *line_no, int *col_no) {
+    if (!file->line_starts)
+        build_line_table(file);
+
+    // line_starts[lo] <= offset < line_starts[lo + 1] となる lo を探す
+    size_t offset = loc - file->contents;
+    int lo = 0, hi = file->nlines;
+    while (hi - lo > 1) {
+        int mid = (lo + hi) / 2;
+        if (file->line_starts[mid] <= offset)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    *line_no = lo + 1;
+    *col_no = offset - file->line_starts[lo] + 1;
+}
+
+_Thread_local ErrorTrap *error_trap;
+
+// 以下の形式でエラーメッセージを報告し終了する。
+//
+// foo.c:10: x = y + 1;
+//               ^ <ここにエラーメッセージ>
+//
+// loc がどのファイルにもなければメッセージだけを表示する。
+// error_trap があれば、表示する代わりに位置とメッセージを残して longjmp する。
+void verror_at(char *loc, char *fmt, va_list ap) {
+    if (error_trap) {
+        va_list ap2;
+        va_copy(ap2, ap);
+        int len = vsnprintf(NULL, 0, fmt, ap2);
+        va_end(ap2);
+
+        error_trap->loc = loc;
+        error_trap->msg = malloc(len + 1);
+        if (error_trap->msg)
+            vsnprintf(error_trap->msg, len + 1, fmt, ap);
+        longjmp(error_trap->jmp, 1);
+    }
+
+    File *file = find_file(loc);
+    if (file) {
+        int line_no, col_no;
+        get_location(file, loc, &line_no, &col_no);
+        char *line = loc - (col_no - 1);
+        char *end = find_line_end(loc);
+
+        int indent = fprintf(stderr, "%s:%d: ", file->name, line_no);
+        fprintf(stderr, "%.*s\n", (int)(end - line), line);
+        fprintf(stderr, "%*s", indent + col_no - 1, ""); // 位置まで空白を表示する
+        fprintf(stderr, "^ ");
+    }
+    vfprintf(stderr, fmt, ap);
+    fprintf(stderr, "\n");
+    exit(1);
+}
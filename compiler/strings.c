@@ -1,4 +1,5 @@
 #include "compiler.h"
+#include <pthread.h>
 
 // printf スタイルのフォーマット文字列を受け取り、フォーマットされた文字列を返します。
 char *format(char *fmt, ...) {
@@ -13,3 +14,117 @@ char *format(char *fmt, ...) {
     fclose(out);
     return buf;
 }
+
+//
+// 識別子のインターン
+//
+// 同じ綴りの識別子には常に同じポインタ (アトム) を返す。
+// アトム同士の比較はポインタの比較だけで済む。
+//
+
+// 表はハッシュ値の上位ビットで INTERN_SHARDS 個に分け、それぞれを別の
+// ロックで守る。トークナイズのワーカースレッドが同時に呼んでも、
+// 別のシャードに入る識別子どうしは待ち合わせない。
+#define INTERN_SHARDS 16
+
+// 複数のスレッドから intern() を呼ぶ間だけ true にする。
+// 1 スレッドで動いている間はロックを取らない。
+bool intern_threaded;
+
+// アトムの文字列を詰めていく領域の大きさ
+#define ATOM_BLOCK_SIZE (64 * 1024)
+
+typedef struct {
+    pthread_mutex_t lock;
+
+    // アトムの文字列を詰めていく領域
+    char *buf;
+    size_t buf_left;
+
+    // オープンアドレス法のハッシュ表。容量は常に 2 のべき乗。
+    char **atoms;
+    int natoms;
+    int cap;
+} AtomShard;
+
+static AtomShard shards[INTERN_SHARDS] = {
+    [0 ... INTERN_SHARDS - 1] = {.lock = PTHREAD_MUTEX_INITIALIZER},
+};
+
+static uint32_t fnv_hash(char *p, int len) {
+    uint32_t hash = 2166136261;
+    for (int i = 0; i < len; i++) {
+        hash ^= (unsigned char)p[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+static char *new_atom(AtomShard *sh, char *p, int len) {
+    if (sh->buf_left < (size_t)len + 1) {
+        size_t sz = len + 1 > ATOM_BLOCK_SIZE ? len + 1 : ATOM_BLOCK_SIZE;
+        sh->buf = malloc(sz);
+        if (!sh->buf)
+            error("メモリ不足です");
+        sh->buf_left = sz;
+    }
+
+    char *atom = sh->buf;
+    memcpy(atom, p, len);
+    atom[len] = '\0';
+    sh->buf += len + 1;
+    sh->buf_left -= len + 1;
+    return atom;
+}
+
+static void rehash_atoms(AtomShard *sh) {
+    int cap = sh->cap ? sh->cap * 2 : 1024;
+    char **tab = calloc(cap, sizeof(char *));
+    if (!tab)
+        error("メモリ不足です");
+
+    for (int i = 0; i < sh->cap; i++) {
+        char *atom = sh->atoms[i];
+        if (!atom)
+            continue;
+        uint32_t h = fnv_hash(atom, strlen(atom));
+        while (tab[h & (cap - 1)])
+            h++;
+        tab[h & (cap - 1)] = atom;
+    }
+
+    free(sh->atoms);
+    sh->atoms = tab;
+    sh->cap = cap;
+}
+
+// 長さ len の文字列 p に対応するアトムを返します。
+char *intern(char *p, int len) {
+    uint32_t h = fnv_hash(p, len);
+    AtomShard *sh = &shards[h >> 28];
+    char *atom = NULL;
+
+    if (intern_threaded)
+        pthread_mutex_lock(&sh->lock);
+
+    // 使用率を 1/2 以下に保つ
+    if (sh->natoms * 2 >= sh->cap)
+        rehash_atoms(sh);
+
+    for (;; h++) {
+        char **slot = &sh->atoms[h & (sh->cap - 1)];
+        if (!*slot) {
+            atom = *slot = new_atom(sh, p, len);
+            sh->natoms++;
+            break;
+        }
+        if (!strncmp(*slot, p, len) && (*slot)[len] == '\0') {
+            atom = *slot;
+            break;
+        }
+    }
+
+    if (intern_threaded)
+        pthread_mutex_unlock(&sh->lock);
+    return atom;
+}
@@ -1,77 +1,61 @@
 #include "compiler.h"
 #include <limits.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <unistd.h>
 
-// 入力ファイル名
-static char *current_filename;
+// 主ファイル
+static File *main_file;
 
-// 入力プログラム
-static char *current_input;
+// 次にトークナイズする位置
+static char *current_pos;
+
+// current_pos がファイルの先頭なら true
+static bool at_file_start;
+
+// トークナイズと関数の本体の解析に使うスレッド数。0 ならオンラインの CPU 数
+int num_threads;
+
+// ワーカースレッドでは、エラーを表示して終了する代わりにここへ longjmp する
+static _Thread_local jmp_buf *lex_error;
 
 void error(char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
-    vfprintf(stderr, fmt, ap);
-    fprintf(stderr, "\n");
-    exit(1);
-}
-
-// 以下の形式でエラーメッセージを報告し終了する。
-//
-// foo.c:10: x = y + 1;
-//               ^ <ここにエラーメッセージ>
-static void verror_at(char *loc, char *fmt, va_list ap) {
-    // `loc` を含む行を探す
-    char *line = loc;
-    while (current_input < line && line[-1] != '\n')
-        line--;
-    
-    char *end = loc;
-    while (*end != '\n')
-        end++;
-
-    // 行番号を取得する
-    int line_no = 1;
-    for (char *p = current_input; p < line; p++)
-        if (*p == '\n')
-            line_no++;
-    // 行を出力する
-    int indent = fprintf(stderr, "%s:%d: ", current_filename, line_no);
-    fprintf(stderr, "%.*s\n", (int)(end - line), line);
-    // エラーメッセージを表示する
-    int pos = loc - line + indent;
-
-    fprintf(stderr, "%*s", pos, ""); // pos 個のスペースを表示する
-    fprintf(stderr, "^ ");
-    vfprintf(stderr, fmt, ap);
-    fprintf(stderr, "\n");
-    exit(1);
+    verror_at(NULL, fmt, ap);
 }
 
 void error_at(char *loc, char *fmt, ...) {
+    if (lex_error)
+        longjmp(*lex_error, 1);
+
     va_list ap;
     va_start(ap, fmt);
-
-    int pos = loc - user_input;
-    fprintf(stderr, "%s\n", user_input);
-    fprintf(stderr, "%*s", pos, ""); // pos個の空白を出力
-    fprintf(stderr, "^ ");
-    vfprintf(stderr, fmt, ap);
-    fprintf(stderr, "\n");
-    exit(1);
+    verror_at(loc, fmt, ap);
 }
 
 void error_tok(Token *tok, char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
-    int pos = tok->loc - user_input;
-    fprintf(stderr, "%s\n", user_input);
-    fprintf(stderr, "%*s", pos, ""); // pos個の空白を出力
-    fprintf(stderr, "^ ");
-    vfprintf(stderr, fmt, ap);
-    fprintf(stderr, "\n");
-    exit(1);
+    verror_at(tok->loc, fmt, ap);
 }
 
+// 各 ID の綴り
+static char *id_str[] = {
+    [P_EQ] = "==", [P_NE] = "!=", [P_LE] = "<=", [P_GE] = ">=",
+    [P_LT] = "<", [P_GT] = ">", [P_ASSIGN] = "=",
+    [P_PLUS] = "+", [P_MINUS] = "-", [P_STAR] = "*", [P_SLASH] = "/", [P_AMP] = "&",
+    [P_LPAREN] = "(", [P_RPAREN] = ")", [P_LBRACE] = "{", [P_RBRACE] = "}",
+    [P_LBRACKET] = "[", [P_RBRACKET] = "]", [P_COMMA] = ",", [P_SEMICOLON] = ";",
+    [KW_RETURN] = "return", [KW_IF] = "if", [KW_ELSE] = "else", [KW_FOR] = "for",
+    [P_NOT] = "!", [P_TILDE] = "~", [P_PERCENT] = "%", [P_PIPE] = "|", [P_CARET] = "^",
+    [P_QUESTION] = "?", [P_COLON] = ":", [P_ANDAND] = "&&", [P_OROR] = "||",
+    [P_SHL] = "<<", [P_SHR] = ">>", [P_HASH] = "#", [P_HASHHASH] = "##",
+    [KW_WHILE] = "while", [KW_INT] = "int", [KW_CHAR] = "char", [KW_SIZEOF] = "sizeof",
+};
+
+// トークンの綴りを文字列と比べます。
+// パーサは ID で比較する。これはディレクティブ名のように ID を持たない綴りに使う。
 bool equal(Token *tok, char *op) {
     size_t op_len = strlen(op);
     if (tok->len != (int)op_len)
@@ -79,35 +63,92 @@ bool equal(Token *tok, char *op) {
     return memcmp(tok->loc, op, op_len) == 0;
 }
 
-Token *skip(Token *tok, char *op) {
-    if (!equal(tok, op)) {
-        if (strlen(op) == 0) {
-            error_tok(tok, "予期しないトークンです");
-        } else {
-            error_tok(tok, "'%s' が必要です", op);
-        }
-    }
-    return tok->next;
+Token *skip(Token *tok, TokenId id) {
+    if (tok->id != id)
+        error_tok(tok, "'%s' が必要です", id_str[id]);
+    return tok + 1;
 }
 
-bool consume(Token **rest, Token *tok, char *str) {
-    if (equal(tok, str)) {
-        *rest = tok->next;
+bool consume(Token **rest, Token *tok, TokenId id) {
+    if (tok->id == id) {
+        *rest = tok + 1;
         return true;
     }
     *rest = tok;
     return false;
 }
 
-// 新しいトークンを作成してcurに繋げる
-static Token *new_token(TokenKind kind, char *start, char *end) {
-    Token *tok = calloc(1, sizeof(Token));
-    tok->kind = kind;
-    tok->loc = start;
-    tok->len = end - start;
+// パーサに渡すトークン列。tokenize_next() がトップレベルの宣言 1 つ分ずつ詰め直す。
+// 配列の位置が変わりうるので、次の宣言に進んだ後はポインタを保持しない。
+static TokenBuf window;
+
+// これまでに 1 度に保持したトークン数の最大値
+int peak_tokens;
+
+// 新しいトークンをトークン列の末尾に追加する
+static Token *new_token(TokenBuf *buf, TokenKind kind, char *start, char *end) {
+    if (buf->len == buf->cap) {
+        buf->cap = buf->cap ? buf->cap * 2 : 4096;
+        buf->toks = realloc(buf->toks, sizeof(Token) * buf->cap);
+        if (!buf->toks)
+            error("メモリ不足です");
+    }
+
+    Token *tok = &buf->toks[buf->len++];
+    *tok = (Token){.loc = start, .len = end - start, .kind = kind};
     return tok;
 }
 
+static int new_str_lit(TokenBuf *buf, char *str, int len) {
+    if (buf->nstrs == buf->strs_cap) {
+        buf->strs_cap = buf->strs_cap ? buf->strs_cap * 2 : 64;
+        buf->strs = realloc(buf->strs, sizeof(StrLit) * buf->strs_cap);
+        if (!buf->strs)
+            error("メモリ不足です");
+    }
+    buf->strs[buf->nstrs] = (StrLit){str, len};
+    return buf->nstrs++;
+}
+
+// src にある tok を dst の末尾に複製します。文字列リテラルの内容は dst の表に移す。
+Token *copy_token(TokenBuf *dst, Token *tok, TokenBuf *src) {
+    Token orig = *tok;
+    Token *copy = new_token(dst, TK_EOF, NULL, NULL);
+    *copy = orig;
+    if (orig.kind == TK_STR) {
+        StrLit *lit = &src->strs[orig.str];
+        copy->str = new_str_lit(dst, lit->str, lit->len);
+    }
+    return copy;
+}
+
+// このスレッドのパーサが読んでいるトークン列。NULL なら window
+static _Thread_local TokenBuf *parse_buf;
+
+// このスレッドのパーサが読むトークン列を buf にします。
+// NULL なら tokenize_next() が返したトークン列に戻す。
+void set_parse_buf(TokenBuf *buf) {
+    parse_buf = buf;
+}
+
+StrLit *get_str_lit(Token *tok) {
+    assert(tok->kind == TK_STR);
+    return &(parse_buf ? parse_buf : &window)->strs[tok->str];
+}
+
+// tokenize_next() が返したトークン列のうち、tok から末尾の TK_EOF までを
+// 新しい領域に複製して buf に入れます。文字列リテラルの添字はそのまま使える。
+void save_tokens(TokenBuf *buf, Token *tok) {
+    int len = window.toks + window.len - tok;
+    *buf = (TokenBuf){.len = len, .cap = len, .nstrs = window.nstrs, .strs_cap = window.nstrs};
+    buf->toks = malloc(sizeof(Token) * len);
+    buf->strs = malloc(sizeof(StrLit) * (window.nstrs + 1));
+    if (!buf->toks || !buf->strs)
+        error("メモリ不足です");
+    memcpy(buf->toks, tok, sizeof(Token) * len);
+    memcpy(buf->strs, window.strs, sizeof(StrLit) * window.nstrs);
+}
+
 static bool startswith(char *p, char *q) {
     return memcmp(p, q, strlen(q)) == 0;
 }
@@ -130,22 +171,81 @@ static int from_hex(char c) {
     return c - 'A' + 10;
 }
 
-static int read_punct(char *p) {
-    if (startswith(p, "==") || startswith(p, "!=") ||
-        startswith(p, "<=") || startswith(p, ">=")) {
-        return 2;
+// p から始まる記号を読み取り、その長さを返します。ID は *id に格納する。
+// ID を持たない記号 (パーサが受け付けないもの) の ID は ID_NONE になる。
+static int read_punct(char *p, TokenId *id) {
+    if (p[1] == '=') {
+        switch (*p) {
+        case '=': *id = P_EQ; return 2;
+        case '!': *id = P_NE; return 2;
+        case '<': *id = P_LE; return 2;
+        case '>': *id = P_GE; return 2;
+        }
+    }
+
+    if (p[0] == p[1]) {
+        switch (*p) {
+        case '&': *id = P_ANDAND; return 2;
+        case '|': *id = P_OROR; return 2;
+        case '<': *id = P_SHL; return 2;
+        case '>': *id = P_SHR; return 2;
+        case '#': *id = P_HASHHASH; return 2;
+        }
     }
 
+    switch (*p) {
+    case '<': *id = P_LT; break;
+    case '>': *id = P_GT; break;
+    case '=': *id = P_ASSIGN; break;
+    case '+': *id = P_PLUS; break;
+    case '-': *id = P_MINUS; break;
+    case '*': *id = P_STAR; break;
+    case '/': *id = P_SLASH; break;
+    case '&': *id = P_AMP; break;
+    case '(': *id = P_LPAREN; break;
+    case ')': *id = P_RPAREN; break;
+    case '{': *id = P_LBRACE; break;
+    case '}': *id = P_RBRACE; break;
+    case '[': *id = P_LBRACKET; break;
+    case ']': *id = P_RBRACKET; break;
+    case ',': *id = P_COMMA; break;
+    case ';': *id = P_SEMICOLON; break;
+    case '!': *id = P_NOT; break;
+    case '~': *id = P_TILDE; break;
+    case '%': *id = P_PERCENT; break;
+    case '|': *id = P_PIPE; break;
+    case '^': *id = P_CARET; break;
+    case '?': *id = P_QUESTION; break;
+    case ':': *id = P_COLON; break;
+    case '#': *id = P_HASH; break;
+    default: *id = ID_NONE; break;
+    }
     return ispunct(*p) ? 1 : 0;
 }
 
-static bool is_keyword(Token *tok) {
-    static char *kw[] = {"return", "if", "else", "for", "while", "int", "sizeof", "char"};
-
-    for (int i = 0; i < sizeof(kw) / sizeof(*kw); i++)
-        if (equal(tok, kw[i]))
-            return true;
-    return false;
+// 長さ len の識別子 p がキーワードならその ID を、そうでなければ ID_NONE を返します。
+// 長さと先頭文字で候補を 1 つに絞り、memcmp は高々 1 回だけ行う。
+static TokenId keyword_id(char *p, int len) {
+    TokenId id = ID_NONE;
+
+    switch (len) {
+    case 2:
+        id = KW_IF;
+        break;
+    case 3:
+        id = (*p == 'f') ? KW_FOR : KW_INT;
+        break;
+    case 4:
+        id = (*p == 'e') ? KW_ELSE : KW_CHAR;
+        break;
+    case 5:
+        id = KW_WHILE;
+        break;
+    case 6:
+        id = (*p == 'r') ? KW_RETURN : KW_SIZEOF;
+        break;
+    }
+    return (id && memcmp(p, id_str[id], len) == 0) ? id : ID_NONE;
 }
 
 static int read_escaped_char(char **new_pos, char *p) {
@@ -190,61 +290,70 @@ static int read_escaped_char(char **new_pos, char *p) {
     }
 }
 
-// 閉じダブルクォーテーションを探す
+// 閉じダブルクォーテーションを探す。行の終わりまでになければ NULL を返す
 static char *string_literal_end(char *p) {
-    char *start = p;
-    for (; *p != '"'; p++) {
-        if (*p== '\n' || *p == '\0')
-            error_at(start, "unclosed string literal");
-        if (*p == '\\')
-            p++;
+    for (;;) {
+        p = find_string_special(p);
+        if (*p == '"')
+            return p;
+        if (*p == '\n' || *p == '\0' || p[1] == '\0')
+            return NULL;
+        // '\\' の次の文字はエスケープされているので読み飛ばす
+        p += 2;
     }
-    return p;
 }
 
-static Token *read_string_literal(char *start) {
+// 閉じていない文字列リテラルは、'"' だけのトークンにする。
+// 読み飛ばす #if の分岐には任意の文字を書けるので、エラーにするのは
+// そのトークンがパーサに渡るときまで待つ。
+static Token *read_string_literal(TokenBuf *tb, char *start) {
     char *end = string_literal_end(start + 1);
+    if (!end) {
+        Token *tok = new_token(tb, TK_PUNCT, start, start + 1);
+        tok->id = ID_NONE;
+        return tok;
+    }
+
     char *buf = calloc(1, end - start);
     int len = 0;
 
     for (char *p = start + 1; p < end;) {
         if (*p == '\\') {
             buf[len++] = read_escaped_char(&p, p + 1);
-        } else {
-            buf[len++] = *p++;
+            continue;
         }
+
+        // 次のエスケープまでをまとめてコピーする
+        char *q = find_string_special(p);
+        memcpy(buf + len, p, q - p);
+        len += q - p;
+        p = q;
     }
-    Token *tok = new_token(TK_STR, start, end + 1);
-    tok->ty = array_of(ty_char, len + 1);
-    tok->str = buf;
+    Token *tok = new_token(tb, TK_STR, start, end + 1);
+    tok->str = new_str_lit(tb, buf, len + 1);
     return tok;
 }
 
-static void convert_keywords(Token *tok) {
-    for (Token *t = tok; t->kind != TK_EOF; t = t->next)
-        if (is_keyword(t))
-            t->kind = TK_KEYWORD;
-}
-
-// 入力文字列pをトークナイズしてそれを返す
-static Token *tokenize(char *filename, char *p) {
-    current_filename = filename;
-    current_input = p;
-    Token head = {};
-    Token *cur = &head;
+// 空白とコメントを読み飛ばす。
+// 改行を読み飛ばした場合は *bol を true にする。ブロックコメントの中の改行と、
+// '\\' の直後の改行 (行の継続) は数えない。
+static char *skip_blank(char *p, bool *bol) {
+    for (;;) {
+        // 行の継続をスキップ
+        if (p[0] == '\\' && p[1] == '\n') {
+            p += 2;
+            continue;
+        }
 
-    while (*p) {
         // 行コメントをスキップ
         if (startswith(p, "//")) {
-            p += 2;
-            while (*p != '\n')
-                p++;
+            p = find_line_end(p + 2);
             continue;
         }
 
         // ブロックコメントをスキップ
         if (startswith(p, "/*")) {
-            char *q = strstr(p + 2, "*/");
+            char *q = find_comment_end(p + 2);
             if (!q)
                 error_at(p, "unclosed block comment");
             p = q + 2;
@@ -253,139 +362,400 @@ static Token *tokenize(char *filename, char *p) {
 
         // 空白文字をスキップ
         if (isspace(*p)) {
-            p++;
+            char *q = skip_space(p);
+            if (memchr(p, '\n', q - p))
+                *bol = true;
+            p = q;
             continue;
         }
 
-        if (isdigit(*p)) {
-            cur = cur->next = new_token(TK_NUM, p, p);
+        return p;
+    }
+}
+
+// p から始まるトークンを 1 つ読み取って buf に追加し、その直後の位置を返す。
+static char *read_token(TokenBuf *buf, char *p) {
+    if (isdigit(*p)) {
+        char *end = skip_digits(p);
+
+        // 整数オーバーフローチェック。
+        // val が INT_MAX を超えたら、それ以上は桁を足さない。
+        long val = 0;
+        for (char *q = p; q < end && val <= INT_MAX; q++)
+            val = val * 10 + (*q - '0');
+        if (val > INT_MAX)
+            error_at(p, "数値が大きすぎます");
+
+        // 数値の後に不正な文字が続いていないかチェック
+        if (isalpha(*end) || *end == '.')
+            error_at(p, "トークナイズできません");
+
+        new_token(buf, TK_NUM, p, end)->val = val;
+        return end;
+    }
 
-            char *q = p;
-            char *endptr;
-            unsigned long val = strtoul(p, &endptr, 10);
-            
-            // 整数オーバーフローチェック
-            if (val > INT_MAX) {
-                error_at(p, "数値が大きすぎます");
-            }
-            
-            // 変換エラーチェック
-            if (endptr == p) {
-                error_at(p, "数値の解析に失敗しました");
-            }
-            
-            // 数値の後に不正な文字が続いていないかチェック
-            if (endptr < p + strlen(p) && (isalpha(*endptr) || *endptr == 'x' || *endptr == '.')) {
-                error_at(p, "トークナイズできません");
+    // 文字列リテラル
+    if (*p == '"')
+        return p + read_string_literal(buf, p)->len;
+
+    // キーワードと識別子。
+    // 大文字はマクロ名にだけ使えるので、マクロ展開の後に tokenize_next() で調べる。
+    if (('a' <= *p && *p <= 'z') || ('A' <= *p && *p <= 'Z') || *p == '_') {
+        char *start = p;
+
+        // 識別子の文字を読み取り
+        p = skip_ident(p);
+
+        int len = p - start;
+        if (len > 255) {
+            error_at(start, "トークナイズできません");
+        }
+
+        // キーワードチェック
+        TokenId id = keyword_id(start, len);
+        if (id)
+            new_token(buf, TK_KEYWORD, start, p)->id = id;
+        else
+            new_token(buf, TK_IDENT, start, p)->name = intern(start, len);
+        return p;
+    }
+
+    TokenId id;
+    int punct_len = read_punct(p, &id);
+    if (punct_len) {
+        new_token(buf, TK_PUNCT, p, p + punct_len)->id = id;
+        return p + punct_len;
+    }
+
+    error_at(p, "トークナイズできません");
+    return NULL;
+}
+
+// tok がトップレベルの宣言の終わりなら true を返す。
+// 宣言は深さ 0 の ';' か、深さ 0 に戻る '}' で終わるとみなす。
+static bool is_decl_end(Token *tok, int *depth) {
+    if (tok->id == P_LBRACE)
+        (*depth)++;
+    else if ((tok->id == P_RBRACE && --*depth <= 0) || (tok->id == P_SEMICOLON && *depth == 0))
+        return true;
+    return false;
+}
+
+// p からトークナイズして buf に追加し、読み終えた位置を返す。
+// 入力の終わりか end (NULL なら制限なし) に達するか、buf のトークンが
+// limit 個になると止まる。bol と space は p の直前が行頭か、空白かを表す。
+//
+// skip_blank() と read_token() をこの関数の中に展開させるため、
+// この関数自体は呼び出し元に展開させない。
+__attribute__((noinline))
+static char *tokenize_range(TokenBuf *buf, char *p, char *end, int limit, bool bol, bool space) {
+    while (buf->len < limit) {
+        char *start = p;
+        p = skip_blank(p, &bol);
+        if (!*p || (end && p >= end))
+            return p;
+
+        p = read_token(buf, p);
+        Token *tok = &buf->toks[buf->len - 1];
+        tok->at_bol = bol;
+        tok->has_space = space || tok->loc != start;
+        bol = space = false;
+    }
+    return p;
+}
+
+// '\0' で終わり、後ろに INPUT_PADDING バイトの 0 が続く p を最後までトークナイズします。
+void tokenize_buffer(TokenBuf *buf, char *p) {
+    tokenize_range(buf, p, NULL, INT_MAX, true, false);
+}
+
+//
+// 並列トークナイズ
+//
+// 大きな入力は、文字列リテラルとコメントの外にある改行の直後で
+// CHUNK_SIZE 程度のチャンクに区切り、ワーカースレッドがチャンクごとに
+// トークナイズする。パーサはチャンクのトークンを先頭から順に受け取るので、
+// 得られるトークン列は 1 スレッドでトークナイズした場合と同じになる。
+//
+// ワーカーがエラーを見つけた場合はそのチャンクを途中で打ち切る。パーサが
+// そこまで進んだ時点で 1 スレッドのトークナイズに切り替え、同じ位置で
+// 同じエラーを報告させる。
+//
+
+#define CHUNK_SIZE (256 * 1024)
+
+// 1 スレッドあたり、パーサより先にトークナイズしておくチャンクの数
+#define CHUNKS_AHEAD 2
+
+typedef struct {
+    char *start;
+    char *end;
+    TokenBuf buf;
+    bool done;   // ワーカーがトークナイズを終えた
+    bool failed; // 途中でエラーが見つかった
+} Chunk;
+
+static Chunk *chunks;
+static int nchunks;
+static int chunks_cap;
+
+static pthread_mutex_t chunk_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t chunk_cond = PTHREAD_COND_INITIALIZER;
+static int next_chunk; // 次にワーカーが受け持つチャンク
+static int cur_chunk;  // プリプロセッサに渡しているチャンク
+static bool cur_ready; // cur_chunk のトークナイズが終わっているのを確認した
+
+static pthread_t *workers;
+static int nworkers;
+
+static void add_chunk(char *start, char *end) {
+    if (nchunks == chunks_cap) {
+        chunks_cap = chunks_cap ? chunks_cap * 2 : 64;
+        chunks = realloc(chunks, sizeof(Chunk) * chunks_cap);
+        if (!chunks)
+            error("メモリ不足です");
+    }
+    chunks[nchunks++] = (Chunk){.start = start, .end = end};
+}
+
+// 入力をチャンクに区切る。
+// トークナイザと同じ規則で文字列リテラルとコメントを読み飛ばしながら進み、
+// 前の区切りから CHUNK_SIZE を過ぎた後の最初の改行の直後で区切る。
+static void split_chunks(char *p) {
+    char *start = p;
+    char *target = p + CHUNK_SIZE;
+
+    for (;;) {
+        // [p, q) には文字列リテラルもコメントも始まらない
+        char *q = p + strcspn(p, "\"/");
+        if (target < q) {
+            char *from = p < target ? target : p;
+            char *nl = memchr(from, '\n', q - from);
+            // 行を継続する改行では区切らない
+            while (nl && nl[-1] == '\\')
+                nl = memchr(nl + 1, '\n', q - nl - 1);
+            if (nl) {
+                add_chunk(start, nl + 1);
+                p = start = nl + 1;
+                target = start + CHUNK_SIZE;
+                continue;
             }
-            
-            cur->val = (int)val;
-            cur->len = endptr - q;
-            p = endptr;
-            continue;
         }
 
-        // 文字列リテラル
+        p = q;
+        if (*p == '\0')
+            break;
+
+        // 文字列リテラル。閉じていない場合はトークナイザと同じく
+        // '"' だけを読み飛ばし、その直後から続ける。
         if (*p == '"') {
-            cur = cur->next = read_string_literal(p);
-            p += cur->len;
+            char *q = find_string_special(p + 1);
+            while (*q == '\\' && q[1])
+                q = find_string_special(q + 2);
+            p = *q == '"' ? q + 1 : p + 1;
             continue;
         }
 
-        // キーワードと識別子
-        if (('a' <= *p && *p <= 'z') || ('A' <= *p && *p <= 'Z')) {
-            char *start = p;
-            
-            // 大文字は許可しない
-            if ('A' <= *p && *p <= 'Z') {
-                error_at(start, "トークナイズできません");
-            }
-            
-            // 識別子の文字を読み取り
-            while (('a' <= *p && *p <= 'z') || ('A' <= *p && *p <= 'Z') || ('0' <= *p && *p <= '9') || *p == '_') {
-                p++;
-            }
-            
-            int len = p - start;
-            if (len > 255) {
-                error_at(start, "トークナイズできません");
-            }
-            
-            // キーワードチェック
-            if (len == 6 && memcmp(start, "return", 6) == 0) {
-                cur = cur->next = new_token(TK_PUNCT, start, p);
-            } else if (len == 2 && memcmp(start, "if", 2) == 0) {
-                cur = cur->next = new_token(TK_PUNCT, start, p);
-            } else if (len == 4 && memcmp(start, "else", 4) == 0) {
-                cur = cur->next = new_token(TK_PUNCT, start, p);
-            } else if (len == 3 && memcmp(start, "for", 3) == 0) {
-                cur = cur->next = new_token(TK_PUNCT, start, p);
-            } else if (len == 5 && memcmp(start, "while", 5) == 0) {
-                cur = cur->next = new_token(TK_PUNCT, start, p);
-            } else if (len == 3 && memcmp(start, "int", 3) == 0) {
-                cur = cur->next = new_token(TK_PUNCT, start, p);
-            } else if (len == 4 && memcmp(start, "char", 4) == 0) {
-                cur = cur->next = new_token(TK_PUNCT, start, p);
-            } else {
-                cur = cur->next = new_token(TK_IDENT, start, p);
-            }
+        if (p[1] == '/') {
+            p = find_line_end(p + 2);
             continue;
         }
 
-        int punct_len = read_punct(p);
-        if (punct_len) {
-            cur = cur->next = new_token(TK_PUNCT, p, p + punct_len);
-            p += punct_len;
+        if (p[1] == '*') {
+            char *end = find_comment_end(p + 2);
+            if (!end) {
+                p += strlen(p);
+                break;
+            }
+            p = end + 2;
             continue;
         }
 
-        error_at(p, "トークナイズできません");
+        p++;
     }
 
-    cur = cur->next = new_token(TK_EOF, p, p);
-    convert_keywords(head.next);
-    return head.next;
-}
-
-// 指定されたファイルの内容を読み取ります。
-static char *read_file(char *path) {
-    FILE *fp;
-    
-    if (strcmp(path, "-") == 0) {
-        // 指定されたファイル名が 「-」 の場合は標準入力から読み取る
-        fp = stdin;
-    } else {
-        fp = fopen(path, "r");
-        if (!fp)
-            error("cannot open %s: %s", path, strerror(errno));
+    add_chunk(start, p);
+}
+
+static void tokenize_chunk(Chunk *c) {
+    jmp_buf jb;
+    if (setjmp(jb)) {
+        lex_error = NULL;
+        c->failed = true;
+        return;
     }
+    lex_error = &jb;
 
-    char *buf;
-    size_t buflen;
-    FILE *out = open_memstream(&buf, &buflen);
+    // チャンクの終わりをまたぐ空白は読み飛ばしてよいが、
+    // 次のチャンクから始まるトークンは読まない。チャンクは改行の直後から始まる。
+    tokenize_range(&c->buf, c->start, c->end, INT_MAX, true, c->start != main_file->contents);
+    lex_error = NULL;
+}
 
-    // ファイル全体を読み込む。
+static void *tokenize_worker(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&chunk_lock);
     for (;;) {
-        char buf2[4096];
-        int n = fread(buf2, 1, sizeof(buf2), fp);
-        if (n == 0)
+        while (next_chunk < nchunks && next_chunk >= cur_chunk + nworkers * CHUNKS_AHEAD)
+            pthread_cond_wait(&chunk_cond, &chunk_lock);
+        if (next_chunk >= nchunks)
             break;
-        fwrite(buf2, 1, n, out);
+
+        Chunk *c = &chunks[next_chunk++];
+        pthread_mutex_unlock(&chunk_lock);
+        tokenize_chunk(c);
+        pthread_mutex_lock(&chunk_lock);
+
+        c->done = true;
+        pthread_cond_broadcast(&chunk_cond);
+    }
+    pthread_mutex_unlock(&chunk_lock);
+    return NULL;
+}
+
+// ワーカーを止めて 1 スレッドのトークナイズに戻る
+static void stop_workers(void) {
+    pthread_mutex_lock(&chunk_lock);
+    next_chunk = nchunks;
+    pthread_cond_broadcast(&chunk_cond);
+    pthread_mutex_unlock(&chunk_lock);
+
+    for (int i = 0; i < nworkers; i++)
+        pthread_join(workers[i], NULL);
+    free(workers);
+    workers = NULL;
+    nworkers = 0;
+    intern_threaded = false;
+
+    for (int i = cur_chunk; i < nchunks; i++) {
+        free(chunks[i].buf.toks);
+        free(chunks[i].buf.strs);
+    }
+    nchunks = 0;
+}
+
+// 使うスレッド数を返します。
+int thread_count(void) {
+    return num_threads > 0 ? num_threads : sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+static void start_workers(char *input) {
+    int n = thread_count();
+    if (n <= 1)
+        return;
+
+    if (nchunks)
+        stop_workers();
+    nchunks = next_chunk = cur_chunk = 0;
+    cur_ready = false;
+    split_chunks(input);
+    if (nchunks <= 1) {
+        nchunks = 0;
+        return;
     }
 
-    if (fp != stdin)
-        fclose(fp);
+    nworkers = n < nchunks ? n : nchunks;
+    workers = calloc(nworkers, sizeof(pthread_t));
+    intern_threaded = true;
+    for (int i = 0; i < nworkers; i++)
+        if (pthread_create(&workers[i], NULL, tokenize_worker, NULL))
+            error("cannot create thread: %s", strerror(errno));
+}
+
+// 次のチャンクのトークン列を返す。前に返したチャンクはここで解放する。
+// すべて渡し終えたか、エラーのあったチャンクに達した場合は NULL を返す。
+static TokenBuf *next_chunk_batch(void) {
+    for (;;) {
+        if (cur_ready) {
+            Chunk *c = &chunks[cur_chunk];
+            if (c->failed)
+                return NULL;
+
+            free(c->buf.toks);
+            free(c->buf.strs);
+
+            pthread_mutex_lock(&chunk_lock);
+            cur_chunk++;
+            pthread_cond_broadcast(&chunk_cond);
+            pthread_mutex_unlock(&chunk_lock);
+            cur_ready = false;
+        }
+
+        if (cur_chunk >= nchunks)
+            return NULL;
+
+        Chunk *c = &chunks[cur_chunk];
+        pthread_mutex_lock(&chunk_lock);
+        while (!c->done)
+            pthread_cond_wait(&chunk_cond, &chunk_lock);
+        pthread_mutex_unlock(&chunk_lock);
+        cur_ready = true;
+
+        if (c->buf.len) {
+            Token *last = &c->buf.toks[c->buf.len - 1];
+            current_pos = last->loc + last->len;
+            at_file_start = false;
+            return &c->buf;
+        }
+    }
+}
+
+// 1 スレッドでトークナイズするときに一度に読むトークンの数
+#define BATCH_SIZE 1024
+
+// 主ファイルの続きのトークン列を返します。入力の終わりでは空のトークン列を返す。
+// 返したトークン列は次に呼び出すまで有効。
+TokenBuf *tokenize_batch(void) {
+    // ワーカーがトークナイズ済みのトークンを受け取る。
+    // チャンクを使い切るかエラーのあったチャンクに達したら、続きは自分で読む。
+    if (nchunks) {
+        TokenBuf *buf = next_chunk_batch();
+        if (buf)
+            return buf;
+        stop_workers();
+    }
+
+    static TokenBuf batch;
+    batch.len = 0;
+    batch.nstrs = 0;
+    current_pos = tokenize_range(&batch, current_pos, NULL, BATCH_SIZE, at_file_start, false);
+    at_file_start = false;
+    return &batch;
+}
+
+// 次のトップレベルの宣言 1 つ分をプリプロセスして、そのトークン列を返す。
+// 末尾には常に TK_EOF のトークンを置くので、入力の終わりに達していれば
+// 先頭が TK_EOF になる。
+Token *tokenize_next(void) {
+    window.len = 0;
+    window.nstrs = 0;
+    int depth = 0;
+    char *end = main_file->contents + main_file->size;
+
+    for (Token *tok; (tok = preprocess(&window));) {
+        // 大文字で始まる識別子はマクロとして展開されなければエラー
+        if (tok->kind == TK_IDENT && 'A' <= *tok->loc && *tok->loc <= 'Z')
+            error_tok(tok, "トークナイズできません");
+        if (tok->kind == TK_PUNCT && *tok->loc == '"')
+            error_tok(tok, "unclosed string literal");
+        if (is_decl_end(tok, &depth)) {
+            end = tok->loc + tok->len;
+            break;
+        }
+    }
 
-    // 最後の行が適切に `\n`で終了していることを確認する。
-    fflush(out);
-    if (buflen == 0 || buf[buflen - 1] != '\n')
-        fputc('\n', out);
-    fclose(out);
-    return buf;
+    new_token(&window, TK_EOF, end, end);
+    if (peak_tokens < window.len)
+        peak_tokens = window.len;
+    return window.toks;
 }
 
-Token *tokenize_file(char *path) {
-    char *input = read_file(path);
-    user_input = input;
-    return tokenize(path, input);
+// 主ファイルを読み込み、tokenize_next() で先頭からトークナイズできるようにします。
+void tokenize_file(char *path) {
+    main_file = load_file(path);
+    char *input = main_file->contents;
+    current_pos = input;
+    at_file_start = true;
+    start_workers(input);
+    init_preprocess(main_file);
 }
@@ -1,4 +1,5 @@
 #include "compiler.h"
+#include <pthread.h>
 
 Type *ty_char = &(Type){TY_CHAR, 1};
 Type *ty_int = &(Type){TY_INT, 8};
@@ -7,54 +8,130 @@ bool is_integer(Type *ty) {
     return ty->kind == TY_CHAR || ty->kind == TY_INT;
 }
 
-Type *copy_type(Type *ty) {
-    Type *ret = calloc(1, sizeof(Type));
-    *ret = *ty;
-    return ret;
+// 正準化した型の表。構造の同じ派生型は 1 つのオブジェクトにまとめるので、
+// 型が等しいかどうかはポインタを比べるだけで分かる。
+// 型はアリーナに置くので、翻訳単位ごとに reset_types() で表を空にする。
+// オープンアドレス法で、容量は常に 2 のべき乗。
+// 関数の本体を並列に解析するスレッドからも使うので、ロックを取って引く。
+static pthread_mutex_t type_lock = PTHREAD_MUTEX_INITIALIZER;
+static Type **type_table;
+static int type_table_len;
+static int type_table_cap;
+
+static uint64_t mix(uint64_t h, uint64_t x) {
+    return (h ^ x) * 0x9e3779b97f4a7c15;
 }
 
-Type *pointer_to(Type *base) {
-    Type *ty = calloc(1, sizeof(Type));
-    ty->kind = TY_PTR;
-    ty->size = 8;
-    ty->base = base;
-    return ty;
+static uint64_t type_hash(Type *ty) {
+    uint64_t h = mix(ty->kind, (uintptr_t)ty->base);
+    h = mix(h, ty->array_len);
+    h = mix(h, (uintptr_t)ty->return_ty);
+    for (int i = 0; i < ty->nparams; i++)
+        h = mix(h, (uintptr_t)ty->params[i]);
+    return h;
 }
 
-Type *array_of(Type *base, int len) {
-    Type *ty = calloc(1, sizeof(Type));
-    ty->kind = TY_ARRAY;
-    ty->size = base->size * len;
-    ty->base = base;
-    ty->array_len = len;
-    return ty;
+// 構成要素はすでに正準化されているので、ポインタを比べればよい
+static bool same_structure(Type *a, Type *b) {
+    if (a->kind != b->kind || a->base != b->base || a->array_len != b->array_len ||
+        a->return_ty != b->return_ty || a->nparams != b->nparams)
+        return false;
+    for (int i = 0; i < a->nparams; i++)
+        if (a->params[i] != b->params[i])
+            return false;
+    return true;
+}
+
+static Type **type_slot(Type *key) {
+    uint64_t hash = type_hash(key);
+    for (int i = (hash >> 32) & (type_table_cap - 1);; i = (i + 1) & (type_table_cap - 1))
+        if (!type_table[i] || same_structure(type_table[i], key))
+            return &type_table[i];
 }
 
-Type *func_type(Type *return_ty) {
-    Type *ty = calloc(1, sizeof(Type));
-    ty->kind = TY_FUNC;
-    ty->return_ty = return_ty;
+static void grow_type_table(void) {
+    Type **old = type_table;
+    int old_cap = type_table_cap;
+    type_table_cap = type_table_cap ? type_table_cap * 2 : 256;
+    type_table = calloc(type_table_cap, sizeof(Type *));
+    if (!type_table) {
+        pthread_mutex_unlock(&type_lock);
+        error("メモリ不足です");
+    }
+    for (int i = 0; i < old_cap; i++)
+        if (old[i])
+            *type_slot(old[i]) = old[i];
+    free(old);
+}
+
+// key と同じ構造の型を返します。まだなければ key を複製して登録する。
+static Type *intern_type(Type *key) {
+    pthread_mutex_lock(&type_lock);
+    if (type_table_len * 2 >= type_table_cap)
+        grow_type_table();
+
+    Type **slot = type_slot(key);
+    if (!*slot) {
+        Type *ty = arena_alloc(ARENA_TYPE, sizeof(Type));
+        *ty = *key;
+        if (key->nparams) {
+            ty->params = arena_alloc(ARENA_TYPE, sizeof(Type *) * key->nparams);
+            memcpy(ty->params, key->params, sizeof(Type *) * key->nparams);
+        }
+        type_table_len++;
+        *slot = ty;
+    }
+
+    Type *ty = *slot;
+    pthread_mutex_unlock(&type_lock);
     return ty;
 }
 
-void add_type(Node *node) {
-    if (!node || node->ty)
-        return;
+// 前の翻訳単位の型はアリーナとともに解放されているので、表を空にします。
+void reset_types(void) {
+    if (type_table)
+        memset(type_table, 0, sizeof(Type *) * type_table_cap);
+    type_table_len = 0;
+}
 
-    add_type(node->lhs);
-    add_type(node->rhs);
-    add_type(node->cond);
-    add_type(node->then);
-    add_type(node->els);
-    add_type(node->init);
-    add_type(node->inc);
+// 構成要素がすでに正準な型 ty と同じ構造の、正準な型を返します。
+// ファイルから読み込んだ型のように、intern_type() を通らずに作った型に使う。
+Type *canonical_type(Type *ty) {
+    switch (ty->kind) {
+    case TY_CHAR:
+        return ty_char;
+    case TY_INT:
+        return ty_int;
+    default:
+        return intern_type(ty);
+    }
+}
 
-    for (Node *n = node->body; n; n = n->next)
-        add_type(n);
+Type *pointer_to(Type *base) {
+    return intern_type(&(Type){.kind = TY_PTR, .size = 8, .base = base});
+}
+
+Type *array_of(Type *base, int len) {
+    return intern_type(&(Type){
+        .kind = TY_ARRAY,
+        .size = base->size * len,
+        .base = base,
+        .array_len = len,
+    });
+}
 
-    for (Node *n = node->args; n; n = n->next)
-        add_type(n);
+Type *func_type(Type *return_ty, Type **params, int nparams) {
+    return intern_type(&(Type){
+        .kind = TY_FUNC,
+        .return_ty = return_ty,
+        .params = params,
+        .nparams = nparams,
+    });
+}
 
+// ノード自身の型を決めます。子はすでに型を持っている。
+// パーサはノードを作るときに一度だけこれを呼ぶので、木をたどり直すことはない。
+void add_type(Node *node) {
     switch (node->kind) {
     case ND_ADD:
     case ND_SUB:
@@ -65,7 +142,7 @@ void add_type(Node *node) {
     return;
     case ND_ASSIGN:
         if (node->lhs->ty->kind == TY_ARRAY)
-            error_tok(node->lhs->tok, "not an lvalue");
+            error_at(node->lhs->loc, "not an lvalue");
         node->ty = node->lhs->ty;
         return;
     case ND_EQ:
@@ -89,20 +166,18 @@ void add_type(Node *node) {
         return;
     case ND_DEREF:
         if (!node->lhs->ty->base)
-            error_tok(node->tok, "invalid pointer dereference");
+            error_at(node->loc, "invalid pointer dereference");
         node->ty = node->lhs->ty->base;
         return;
     case ND_STMT_EXPR:
-        if (node->body) {
-            Node *stmt = node->body;
-            while (stmt->next)
-                stmt = stmt->next;
+        if (node->nbody) {
+            Node *stmt = node->body[node->nbody - 1];
             if (stmt->kind == ND_EXPR_STMT) {
                 node->ty =stmt->lhs->ty;
                 return;
             }
         }
-        error_tok(node->tok, "statement expression returning void is not supported");
+        error_at(node->loc, "statement expression returning void is not supported");
         return;
     default:
         break;
@@ -11,6 +11,24 @@ int main() {
     ASSERT(10, -10+20);
     ASSERT(10, - -10);
     ASSERT(10, - - +10);
+    ASSERT(-9, -(1+2)*3);
+    ASSERT(5, 1*2+3);
+    ASSERT(2, 8/2/2);
+    ASSERT(4, 8-2-2);
+    ASSERT(1, 1<2==1);
+    ASSERT(1, 2>1==2>=1);
+    ASSERT(10, ((((((((((10)))))))))));
+
+    ASSERT(-5, -(2+3));
+    ASSERT(2, 7/3);
+    ASSERT(1, 3*4==12);
+    ASSERT(1073741824, (2147483647+1)/2);
+    ASSERT(8, ({ int x; x=8; x*1; }));
+    ASSERT(8, ({ int x; x=8; 1*x+0; }));
+    ASSERT(0, ({ int x; x=8; x*0; }));
+    ASSERT(3, ({ int i; i=0; (i=3)*0; i; }));
+    ASSERT(1, ({ char c; sizeof(c*1); }));
+    ASSERT(8, ({ char c; sizeof(0+c); }));
 
     ASSERT(0, 0==1);
     ASSERT(1, 42==42);
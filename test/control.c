@@ -5,6 +5,10 @@ int main() {
     ASSERT(3, ({ int x; if (1-1) x=2; else x=3; x; }));
     ASSERT(2, ({ int x; if (1) x=2; else x=3; x; }));
     ASSERT(2, ({ int x; if (2-1) x=2; else x=3; x; }));
+    ASSERT(3, ({ int x; int y; y=3; if (y==1) x=1; else if (y==2) x=2; else if (y==3) x=3; else x=4; x; }));
+    ASSERT(4, ({ int x; int y; y=5; if (y==1) x=1; else if (y==2) x=2; else if (y==3) x=3; else x=4; x; }));
+    ASSERT(0, ({ int x; int y; x=0; y=5; if (y==1) x=1; else if (y==2) x=2; x; }));
+    ASSERT(2, ({ int x; int y; x=0; y=1; if (y==1) if (y==2) x=1; else x=2; else x=3; x; }));
 
     ASSERT(55, ({ int i=0; int j=0; for (i=0; i<=10; i=i+1) j=i+j; j; }));
 
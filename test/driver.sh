@@ -18,8 +18,104 @@ rm -f $tmp/out
 [ -f $tmp/out ]
 check -o
 
+# -c
+echo 'int x; int main() { char *s = "*"; x = s[0]; return x; }' > $tmp/obj.c
+./a.out -c -o $tmp/obj.o $tmp/obj.c
+[ "$(head -c 4 $tmp/obj.o | tail -c 3)" = ELF ]
+check -c
+
+# ELF をリンクできる環境なら、リンクして実行する
+if [ "$(uname)" = Linux ]; then
+    cc -o $tmp/obj $tmp/obj.o && $tmp/obj
+    [ $? -eq 42 ]
+    check '-c link'
+fi
+
 # --help
 ./a.out --help 2>&1 | grep -q a.out
 check --help
 
+# --stats
+echo 'int x; int main() { return x; }' > $tmp/stats.c
+./a.out --stats -o $tmp/out $tmp/stats.c 2> $tmp/stats.err
+grep -q 'peak tokens: 10 ' $tmp/stats.err && grep -q 'arena: node [1-9]' $tmp/stats.err
+check --stats
+
+# 診断メッセージはエラーのある行だけを表示する
+printf 'int main() {\n  return A;\n}\n' > $tmp/diag.c
+./a.out -o $tmp/out $tmp/diag.c 2> $tmp/diag.err
+[ "$(head -1 $tmp/diag.err)" = "$tmp/diag.c:2:   return A;" ] && [ $(wc -l < $tmp/diag.err) -eq 2 ]
+check diagnostics
+
+# -I
+mkdir -p $tmp/inc
+echo 'int inc;' > $tmp/inc/inc.h
+printf '#include <inc.h>\n#include "inc.h"\nint main() { return inc; }\n' > $tmp/inc.c
+./a.out -I $tmp/inc --stats -o $tmp/out $tmp/inc.c 2>&1 | grep -q 'headers: 1 read, 1 cached, 0 skipped'
+check -I
+
+# #else のある #ifndef はインクルードガードとみなさない
+printf '#ifndef X\nint a;\n#else\nint b;\n#endif\n' > $tmp/else.h
+printf '#include "else.h"\n#define X\n#include "else.h"\nint main() { return b; }\n' > $tmp/else.c
+./a.out --stats -o $tmp/out $tmp/else.c 2>&1 | grep -q 'headers: 1 read, 1 cached, 0 skipped'
+check 'include guard with #else'
+
+# --threads
+# 複数のチャンクに分かれる大きさの入力を作り、1 スレッドの場合と比べる
+cat <<'EOF' > $tmp/unit.c
+/* "comment
+ */ int fNUM() { char *s = "a\
+/*\"//"; // "
+    return s[0]; }
+EOF
+awk '{ unit[NR] = $0 }
+END {
+    for (i = 0; i < 10000; i++)
+        for (j = 1; j <= NR; j++) {
+            line = unit[j]
+            sub(/NUM/, i, line)
+            print line
+        }
+}' $tmp/unit.c > $tmp/big.c
+./a.out --threads=1 -o $tmp/big1.s $tmp/big.c &&
+./a.out --threads=4 -o $tmp/big4.s $tmp/big.c &&
+cmp -s $tmp/big1.s $tmp/big4.s
+check --threads
+
+# 関数の本体のエラーは、1 スレッドの場合と同じものを報告する
+sed -e '20004s/s\[0\]/t[0]/' -e '30004s/s\[0\]/u[0]/' $tmp/big.c > $tmp/body.c
+./a.out --threads=1 -o /dev/null $tmp/body.c 2> $tmp/err1
+./a.out --threads=4 -o /dev/null $tmp/body.c 2> $tmp/err4
+grep -q 'return t\[0\]' $tmp/err4 && cmp -s $tmp/err1 $tmp/err4
+check '--threads body error'
+
+# コード生成のエラーも、1 スレッドの場合と同じものを報告する
+sed -e '20004s/return s\[0\];/1 = 2;/' -e '30004s/return s\[0\];/2 = 1;/' $tmp/big.c > $tmp/gen.c
+./a.out --threads=1 -o /dev/null $tmp/gen.c 2> $tmp/err1
+./a.out --threads=4 -o /dev/null $tmp/gen.c 2> $tmp/err4
+grep -q 'not an lvalue' $tmp/err4 && cmp -s $tmp/err1 $tmp/err4
+check '--threads codegen error'
+
+# 関数は生成し終えたものから解放するので、アリーナの最大は確保した合計より小さい
+./a.out --stats -o /dev/null $tmp/big.c 2>&1 |
+    awk '/^arena:/ { found = 1; ok = $(NF - 1) * 2 < $(NF - 4) } END { exit !(found && ok) }'
+check 'streaming memory'
+
+# --emit-ast と --load-ast
+./a.out -I $tmp/inc --emit-ast=$tmp/inc.ast -o $tmp/inc1.s $tmp/inc.c &&
+./a.out --load-ast=$tmp/inc.ast -o $tmp/inc2.s &&
+cmp -s $tmp/inc1.s $tmp/inc2.s
+check --load-ast
+
+# ソースやヘッダが変わっていれば読み込まない
+echo 'int inc2;' >> $tmp/inc/inc.h
+./a.out --load-ast=$tmp/inc.ast -o $tmp/inc2.s 2>&1 | grep -q 'inc.h has changed'
+check '--load-ast out of date'
+
+echo 'int main() { return A; }' >> $tmp/big.c
+./a.out --threads=1 -o /dev/null $tmp/big.c 2> $tmp/err1
+./a.out --threads=4 -o /dev/null $tmp/big.c 2> $tmp/err4
+grep -q 'トークナイズできません' $tmp/err4 && cmp -s $tmp/err1 $tmp/err4
+check '--threads error'
+
 echo OK
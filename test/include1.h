@@ -0,0 +1,7 @@
+#ifndef INCLUDE1_H
+#define INCLUDE1_H
+
+#define INCLUDE1 1
+int include1_count;
+
+#endif
@@ -0,0 +1,4 @@
+#pragma once
+
+#define INCLUDE2 2
+int include2_count;
@@ -0,0 +1,93 @@
+#include "test.h"
+#include "include1.h"
+#include "include1.h"
+#include "include2.h"
+#include "include2.h"
+
+#define ONE 1
+#define TWO (ONE + ONE)
+#define EMPTY
+#define add(a, b) ((a) + (b))
+#define twice(x) add(x, x)
+#define str(x) #x
+#define xstr(x) str(x)
+#define cat(a, b) a##b
+#define call(f) f(3, 4)
+#define sub(a, b) \
+    ((a) - \
+     (b))
+
+#if 0
+#error not skipped
+#elif ONE + 1 == TWO && defined(TWO) && !defined UNDEFINED
+#define IF 1
+#else
+#define IF 2
+#endif
+
+#ifdef ONE
+#define IFDEF 3
+#endif
+#ifndef ONE
+#define IFDEF 4
+#endif
+
+#if 0
+It's skipped, so an unclosed " or ' is allowed here.
+#endif
+
+#if 0
+#if 1
+#define NESTED 5
+#endif
+#else
+#define NESTED 6
+#endif
+
+#if (1 << 3) % 5 == 3 ? 1 : 0
+#define EXPR 7
+#endif
+
+#define UNDEF 8
+#undef UNDEF
+#ifdef UNDEF
+#error not undefined
+#endif
+
+int self;
+#define self self + 1
+
+int main() {
+    ASSERT(1, ONE);
+    ASSERT(2, TWO);
+    ASSERT(5, EMPTY 5);
+    ASSERT(7, add(3, 4));
+    ASSERT(9, add(add(1, 2), (6)));
+    ASSERT(6, twice(TWO + ONE));
+    ASSERT(7, call(add));
+    ASSERT(3, sub(5, 2));
+    ASSERT(2, ({ int add=2; add; }));
+    ASSERT(1, self);
+
+    ASSERT(4, sizeof(str(ONE)));
+    ASSERT(2, sizeof(xstr(ONE)));
+    ASSERT(34, str("a")[0]);
+    ASSERT(92, str("\n")[1]);
+    ASSERT(6, sizeof(str(a  +  b)));
+
+    ASSERT(12, cat(1, 2));
+    ASSERT(3, ({ int ab=3; cat(a, b); }));
+    ASSERT(1, cat(, ONE));
+    ASSERT(2, cat(T, WO));
+
+    ASSERT(1, IF);
+    ASSERT(3, IFDEF);
+    ASSERT(6, NESTED);
+    ASSERT(7, EXPR);
+    ASSERT(1, INCLUDE1);
+    ASSERT(2, INCLUDE2);
+    ASSERT(0, include1_count);
+
+    printf("OK\n");
+    return 0;
+}
@@ -38,6 +38,14 @@ int main() {
     ASSERT(3, ({ int x[2][3]; int *y=x; y[3]=3; x[1][0]; }));
     ASSERT(4, ({ int x[2][3]; int *y=x; y[4]=4; x[1][1]; }));
     ASSERT(5, ({ int x[2][3]; int *y=x; y[5]=5; x[1][2]; }));
+    ASSERT(-4, ({ int x[2]; x[1]=4; -x[1]; }));
+    ASSERT(4, ({ int x[2]; int *p=x; x[1]=4; *&p[1]; }));
+    ASSERT(3, ({ int x[2]; x[0]=0; x[1]=3; (x)[x[0]+1]; }));
+    ASSERT(8, ({ int x[2]; sizeof x[1]; }));
+    ASSERT(5, ({ int x[3]; x[2]=5; *(x+1+1); }));
+    ASSERT(5, ({ int x[3]; x[2]=5; *(x+3-1); }));
+    ASSERT(2, ({ char x[3]; x[2]=2; x[2]; }));
+    ASSERT(2, ({ char x[3]; &x[2]-x; }));
 
     printf("OK\n");
     return 0;